@@ -1,18 +1,23 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/perf_event.h>
 #include <pthread.h>
-#include <signal.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/resource.h>
+#include <sys/mman.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -24,27 +29,43 @@ __attribute__((noreturn)) void unreachable(const char *message) {
 
 // Job definition
 
-enum job_status {
-    ST_D000 = 0,
-    ST_D001 = 1,
-    ST_D010 = 2,
-    ST_D011 = 3,
-    ST_D100 = 4,
-    ST_D101 = 5,
-    ST_D110 = 6,
-    ST_D111 = 7,
-    ST_Complete = 8,
-};
+// A product is split into grid x grid x grid tasks. Task t multiplies
+// block (i, k) of the left job by block (k, j) of the right job and adds
+// it into block (i, j) of the result, where i = t / grid^2,
+// j = (t / grid) % grid and k = t % grid.
+#define MAX_GRID 16
 
-enum block_status {
-    BS_Assign,
-    BS_Add,
-    BS_Done,
-};
+int grid;
 
-char *job_status_to_str(enum job_status status);
+struct block_id {
+    int i;
+    int j;
+    int k;
+};
 
-#define MAT_SIZE 1000
+struct block_id task_to_block_id(int task);
+void block_range(int b, int *start, int *end);
+
+// With strassen_levels > 0, a product is instead computed with 7 half size
+// multiplications (Strassen-Winograd), in 3 phases of tasks which each
+// wait for the previous one: 14 tasks summing quadrants of the operands
+// into the left and right factors, 7 multiplying them, themselves going
+// down strassen_levels - 1 more levels of recursion, and 4 summing the
+// products into the quadrants of the result. grid is then unused.
+#define STRASSEN_MULTIPLY_TASK 14
+#define STRASSEN_COMBINE_TASK 21
+#define STRASSEN_TASKS 25
+#define MAX_STRASSEN_LEVELS 8
+// Below this size the recursion falls back to the classical kernel
+#define STRASSEN_MIN_SIZE 64
+
+int strassen_levels;
+
+int product_tasks();
+int strassen_bench();
+
+#define DEFAULT_MAT_SIZE 1000
+#define MAX_MAT_SIZE 16384
 #define MAT_EL_MIN -9
 #define MAT_EL_MAX 9
 #define MAT_ID_MIN 1
@@ -53,163 +74,987 @@ char *job_status_to_str(enum job_status status);
 struct job {
     int prod_num;
     int mat_id;
-    enum job_status status;
-    enum block_status blocks[4];
-    long matrix[MAT_SIZE][MAT_SIZE];
+    // Tasks pushed to a consumer's deque, product_tasks() once every one of
+    // them has been
+    int status;
+    // Tasks finished, in total and per result block. blocks[b] is
+    // protected by the queue's block_locks[slot][b].
+    atomic_int tasks_done;
+    int blocks[MAX_GRID * MAX_GRID];
+    // Largest magnitude the elements can have, and the size in bytes of
+    // the integers they are stored in
+    uint64_t bound;
+    int width;
+    // Offset of the mat_size x mat_size row-major matrix from the job
+    // itself, as every process maps the segment at its own address. It is
+    // in a buffer of the job's width, taken along with the slot.
+    ptrdiff_t matrix_off;
+};
+
+int mat_size;
+
+static inline void *job_matrix(struct job *job) {
+    return (char *)job + job->matrix_off;
+}
+
+// Element storage. With narrow set, every matrix is kept in the narrowest
+// of int16, int32 and int64 which holds its bound. Products are exact as
+// long as their bound fits int64, and wrap around like plain long
+// arithmetic past that. The bounds are worst cases, not the values seen.
+// Matrices are kept in buffers of their own width, see buffer_layout, so
+// runs short enough for few products to need int64 also take less memory.
+bool narrow;
+
+// Storage widths, indexed by width_index
+#define NUM_WIDTHS 3
+
+uint64_t leaf_bound();
+uint64_t product_bound(uint64_t left, uint64_t right);
+int width_for(uint64_t bound);
+
+static inline int width_index(int width) {
+    return width == 2 ? 0 : width == 4 ? 1 : 2;
+}
+
+static inline long elem_get(const void *matrix, int width, size_t i) {
+    switch (width) {
+        case 2:
+            return ((const int16_t *)matrix)[i];
+        case 4:
+            return ((const int32_t *)matrix)[i];
+        default:
+            return ((const int64_t *)matrix)[i];
+    }
+}
+
+static inline void elem_set(void *matrix, int width, size_t i, long value) {
+    switch (width) {
+        case 2:
+            ((int16_t *)matrix)[i] = value;
+            break;
+        case 4:
+            ((int32_t *)matrix)[i] = value;
+            break;
+        default:
+            ((int64_t *)matrix)[i] = value;
+            break;
+    }
+}
+
+// xoshiro256** run in PRNG_LANES independent lanes, laid out so that all
+// of them can be stepped at once with vector instructions
+#define PRNG_LANES 8
+
+struct prng {
+    uint64_t s[4][PRNG_LANES];
 };
 
-void job_init(struct job *job, int prod_num, int mat_id);
-void job_print(struct job *job);
+void prng_seed(struct prng *prng, uint64_t seed);
+
+void job_init(struct job *job, int prod_num, int mat_id, struct prng *prng);
 
 // Queue
 
 #define MAX_INSERT_JOBS 7
-#define QUEUE_SIZE (MAX_INSERT_JOBS + 1)
+// Room for a product of every 2 jobs besides the jobs themselves
+#define MAX_PRODUCTS (MAX_INSERT_JOBS / 2)
+#define QUEUE_SIZE (MAX_INSERT_JOBS + MAX_PRODUCTS)
+
+// Tasks are handed out through a deque per consumer (Chase-Lev). Its
+// owner pushes and pops at the bottom, while the other consumers steal from
+// the top with a compare-and-swap, so running a task takes no lock. Each
+// entry is the slot of the product and the task number in it, packed by
+// TASK_PACK.
+#define MAX_CONSUMERS 64
+#define DEQUE_SIZE 1024
+#define TASK_PACK(slot, task) ((slot) << 16 | (task))
+
+struct task_deque {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    atomic_int tasks[DEQUE_SIZE];
+};
+
+int num_consumers;
+
+// Place of a job slot in the chain of matrices to multiply
+struct slot {
+    // Neighbours in the chain, -1 at its ends
+    int prev;
+    int next;
+    // For a job in the chain, the slot its product with a neighbour is
+    // being built in, or -1
+    int product;
+    // For a product being built, the slots of its operands, and the
+    // temporary area of its Strassen-Winograd factors and products
+    int left;
+    int right;
+    int temp;
+};
 
+// The queue is a chain of up to MAX_INSERT_JOBS jobs, linked in the order
+// they were published. Producers reserve a slot, generate the job in it
+// and then publish it. Matrix multiplication being associative, any 2
+// adjacent jobs can be multiplied as soon as both are there, and their
+// product takes their place in the chain. Pairs are formed from the front
+// of the chain and several products are built at once, so M queued
+// matrices are reduced as a balanced tree in about log2(M) rounds. Jobs
+// never move: only slot indices are relinked.
+//
+// The condition variables go with lock. task_ready is broadcast when a
+// product is started or when done is set, slot_free when a job leaves the
+// chain and all_done once the last product is complete.
+//
+// lock is only taken to relink jobs and to move the ready tasks of a
+// product, up to DEQUE_SIZE at once, into the deque of the consumer which
+// claims them. The others then steal those one by one without the lock.
+// Consumers read the operands in place, as those are not written to until
+// all the tasks of their product are done, and add into block b of the
+// product built in slot s under block_locks[s][b].
 struct queue {
     struct job jobs[QUEUE_SIZE];
+    struct slot slots[QUEUE_SIZE];
+    int free_slots[QUEUE_SIZE];
+    int nfree;
+    // Matrix buffers of each width which no job holds, by their offset
+    // from the queue
+    ptrdiff_t free_buffers[NUM_WIDTHS][QUEUE_SIZE];
+    int nfree_buffers[NUM_WIDTHS];
+    // Temporary areas of Strassen-Winograd products, at temps_off from
+    // the queue, which are only there with strassen_levels > 0
+    int free_temps[MAX_PRODUCTS];
+    int nfree_temps;
+    ptrdiff_t temps_off;
+    int first;
+    int last;
+    // Jobs in the chain, slots reserved for jobs being generated and
+    // products being built
     int cnt;
+    int reserved;
+    int products;
+    bool done;
+    // When the first and the last job were published and done was set
+    long long first_publish_ns;
+    long long last_publish_ns;
+    long long done_ns;
     pthread_mutex_t lock;
+    pthread_cond_t task_ready;
+    pthread_cond_t slot_free;
+    pthread_cond_t all_done;
+    pthread_mutex_t block_locks[QUEUE_SIZE][MAX_GRID * MAX_GRID];
+    struct task_deque deques[MAX_CONSUMERS];
 };
 
 struct shared_mem;
 
-void queue_init(struct queue *queue);
-bool queue_push(struct queue *queue, struct job *job, struct shared_mem *mem);
-bool queue_pop(struct queue *queue);
-void queue_rotate_right(struct queue *queue, int k);
-int queue_cnt(struct queue *queue);
-void queue_incr_cnt(struct queue *queue);
+void queue_init(struct queue *queue, char *matrices, char *temps);
+long *queue_temp(struct queue *queue, int temp);
+int queue_reserve(struct queue *queue, struct shared_mem *mem);
+void queue_publish(struct queue *queue, int slot);
+int queue_next_task(struct queue *queue, int cons_id, int *task);
+struct job *queue_first(struct queue *queue);
+void queue_product_done(struct queue *queue, int result,
+                        struct shared_mem *mem);
+
+// Log. Producers and consumers append fixed-size records to a ring in the
+// shared segment, which main drains, formatting them and writing them out
+// a batch at a time. Writers take a position with an atomic increment and
+// each record's seq says whether it is free to fill (position), filled
+// (position + 1) or being filled, so logging takes no lock. Writers wait
+// for the drain only when the ring is full. log_level (-l) picks which
+// records are kept: none, the jobs, products and kernel rates, or also
+// every task.
+#define LOG_RING_SIZE 4096
+#define LOG_DRAIN_MS 1
+
+enum log_level { LOG_OFF, LOG_SUMMARY, LOG_VERBOSE };
+
+enum log_kind { LOG_PRODUCED, LOG_PRODUCT, LOG_GOPS, LOG_BLOCK, LOG_STRASSEN };
+
+enum log_message {
+    MESS_READING,
+    MESS_COPYING,
+    MESS_ADDING,
+    MESS_LEFT_FACTOR,
+    MESS_RIGHT_FACTOR,
+    MESS_MULTIPLYING,
+    MESS_QUADRANT
+};
+
+struct log_record {
+    atomic_long seq;
+    short kind;
+    short message;
+    int worker;
+    int prod_id;
+    int mat_id;
+    int a;
+    int b;
+    double x;
+    double y;
+};
+
+struct log_ring {
+    _Alignas(64) atomic_long tail;
+    // Producers and consumers which have not exited yet
+    atomic_int writers;
+    // Only used by the drain
+    _Alignas(64) long head;
+    struct log_record records[LOG_RING_SIZE];
+};
+
+enum log_level log_level = LOG_VERBOSE;
+
+// Ring of the calling producer or consumer
+static __thread struct log_ring *worker_log;
+
+void log_init(struct log_ring *log, int writers);
+struct log_record *log_begin(enum log_kind kind);
+void log_commit(struct log_record *record);
+int log_drain(struct log_ring *log);
+
+// Instrumentation. Every producer and consumer times what it spends its
+// life doing with the monotonic clock, into its own worker_stats in the
+// shared segment, which main reads once they are all gone. Copy and
+// accumulate are putting a block product into its result block for the
+// first time and adding into it afterwards, or with Strassen-Winograd
+// summing quadrants into the factors and summing products into the result.
+enum phase {
+    PHASE_GENERATE,
+    PHASE_QUEUE_WAIT,
+    PHASE_LOCK_WAIT,
+    PHASE_COPY,
+    PHASE_MULTIPLY,
+    PHASE_ACCUMULATE,
+    PHASES
+};
+
+enum lock_kind { LOCK_QUEUE, LOCK_BLOCK, LOCK_KINDS };
+
+struct lock_stats {
+    long long acquired;
+    long long contended;
+    long long wait_ns;
+};
+
+struct worker_stats {
+    _Alignas(64) long long start_ns;
+    long long end_ns;
+    long long ns[PHASES];
+    struct lock_stats locks[LOCK_KINDS];
+    // Jobs generated or tasks run, and the operations of the
+    // multiplications, counted as the classical product would do them
+    long long items;
+    double ops;
+};
+
+#define MAX_PRODUCERS 64
+
+// Stats of the calling producer or consumer, NULL in main
+static __thread struct worker_stats *worker_stats;
+
+static inline long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void stats_lock(pthread_mutex_t *lock, enum lock_kind kind);
+void stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock);
+void write_report(FILE *out, struct shared_mem *mem, int np, int nw,
+                  bool threads, long long start_ns, long long end_ns);
 
 // Shared memory
 
 int max_job_created;
+int max_prod_delay_ms;
 
 struct shared_mem {
     int job_created;
     struct queue queue;
     pthread_mutex_t cntr_lock;
+    // dTLB load misses of the consumers, and how many of them could not
+    // count theirs
+    atomic_llong dtlb_misses;
+    atomic_int dtlb_uncounted;
+    // Most of the segment in transparent huge pages any consumer saw, in
+    // kB, or -1 if it could not be read
+    atomic_llong thp_kb;
+    struct worker_stats producers[MAX_PRODUCERS];
+    struct worker_stats consumers[MAX_CONSUMERS];
+    struct log_ring log;
 };
 
+// With huge_pages set (-H), the segment is backed by huge pages from the
+// ones reserved in the system, or failing that the kernel is asked for
+// transparent huge pages, which need shmem_enabled for a System V segment.
+// The segment size is then rounded up to HUGE_PAGE_SIZE, the default huge
+// page size on x86-64.
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+enum page_backing { PAGES_NORMAL, PAGES_TRANSPARENT, PAGES_HUGETLB };
+
+bool huge_pages;
+enum page_backing page_backing;
+// dTLB load misses of an earlier run with 4 KB pages (-B), to show what
+// the huge pages saved, or -1
+long long dtlb_baseline = -1;
+
+long long mapping_huge_kb(const void *addr);
+
+int shared_mem_create();
+struct shared_mem *shared_mem_map();
 struct shared_mem *shared_mem_attach(int shmid);
 void shared_mem_release(struct shared_mem *mem);
-void shared_mem_init(struct shared_mem *mem);
+int buffer_count(int index);
+size_t buffer_bytes(int index);
+size_t matrices_bytes();
+size_t temp_bytes();
+size_t shared_mem_size();
+void shared_mem_init(struct shared_mem *mem, int workers);
+
+void producer(int prod_id, struct shared_mem *mem);
+void consumer(int cons_id, struct shared_mem *mem);
+
+// Producers and consumers are forked processes attached to a System V
+// segment, or with -t threads sharing an anonymous mapping. Threads are
+// each pinned to one of the CPUs the program may run on, consumers first,
+// and every consumer faults in its share of the rows of each matrix before
+// any work starts, so that the pages are placed on its NUMA node.
+struct worker {
+    pthread_t thread;
+    int id;
+    bool consumer;
+    struct shared_mem *mem;
+    pthread_barrier_t *start;
+};
 
-void producer(int prod_id, int shmid);
-void consumer(int cons_id, int shmid);
+void worker_process(int id, bool is_consumer, struct shared_mem *mem);
+struct worker *start_threads(struct shared_mem *mem, int np, int nw,
+                             pthread_barrier_t *start);
+void first_touch(struct shared_mem *mem, int cons_id);
+
+// Every producer and consumer has its own seed, as threads or processes
+static __thread unsigned int rand_state;
 
 int gen_seed();
-long trace(long *matrix);
-void adjust_stack_size();
-void print_time_taken(time_t tot_time);
+long trace(const void *matrix, int width);
+void print_time_taken(long long tot_ns);
+void print_dtlb_misses(struct shared_mem *mem, bool threads);
+
+int usage() {
+    fprintf(stderr,
+            "Usage: [-d max-producer-delay-ms] [-g grid] [-n matrix-size] "
+            "[-w] [-S strassen-levels] [-t] [-H [-B 4k-dtlb-misses]] "
+            "[-j report.json] [-l off|summary|verbose] <np> <nw> "
+            "<num-matrices>\n"
+            "       -b (benchmark Strassen-Winograd against the classical "
+            "kernel)\n");
+    return 1;
+}
 
 int main(int argc, char *argv[]) {
-    int shmid, np, nw;
+    int shmid, np, nw, opt;
     struct shared_mem *main_mem;
-    pid_t cpid, *child_pids;
-    time_t start_time, end_time;
-
-    if (argc != 4) {
-        fprintf(stderr, "Usage: <np> <nw> <num-matrices>\n");
+    struct worker *workers = NULL;
+    pthread_barrier_t start;
+    bool threads = false;
+    const char *report_path = NULL;
+    FILE *report;
+    pid_t cpid;
+    long long start_ns, end_ns;
+    struct timespec deadline;
+    int drained;
+
+    grid = 2;
+    mat_size = DEFAULT_MAT_SIZE;
+    while ((opt = getopt(argc, argv, "bd:g:n:wS:tHB:j:l:")) != -1) {
+        switch (opt) {
+            case 'b':
+                return strassen_bench();
+            case 'd':
+                max_prod_delay_ms = atoi(optarg);
+                break;
+            case 'g':
+                grid = atoi(optarg);
+                break;
+            case 'n':
+                mat_size = atoi(optarg);
+                break;
+            case 'w':
+                narrow = true;
+                break;
+            case 'S':
+                strassen_levels = atoi(optarg);
+                break;
+            case 't':
+                threads = true;
+                break;
+            case 'H':
+                huge_pages = true;
+                break;
+            case 'B':
+                dtlb_baseline = atoll(optarg);
+                break;
+            case 'j':
+                report_path = optarg;
+                break;
+            case 'l':
+                if (strcmp(optarg, "off") == 0)
+                    log_level = LOG_OFF;
+                else if (strcmp(optarg, "summary") == 0)
+                    log_level = LOG_SUMMARY;
+                else if (strcmp(optarg, "verbose") == 0)
+                    log_level = LOG_VERBOSE;
+                else
+                    return usage();
+                break;
+            default:
+                return usage();
+        }
+    }
+    if (argc - optind != 3) return usage();
+    np = atoi(argv[optind]);
+    nw = atoi(argv[optind + 1]);
+    max_job_created = atoi(argv[optind + 2]);
+    if (max_prod_delay_ms < 0) {
+        fprintf(stderr, "The producer delay cannot be negative\n");
+        return 1;
+    }
+    if (mat_size < 1 || mat_size > MAX_MAT_SIZE) {
+        fprintf(stderr, "The matrix size must be between 1 and %d\n",
+                MAX_MAT_SIZE);
+        return 1;
+    }
+    // Checked even when Strassen-Winograd leaves the grid unused, so that a
+    // bad -g never goes unnoticed
+    if (grid < 1 || grid > MAX_GRID ||
+        (strassen_levels == 0 && grid > mat_size)) {
+        fprintf(stderr,
+                "The grid must be between 1 and %d blocks wide, and no "
+                "wider than the matrices\n",
+                MAX_GRID);
+        return 1;
+    }
+    if (strassen_levels < 0 || strassen_levels > MAX_STRASSEN_LEVELS) {
+        fprintf(stderr, "The Strassen levels must be between 0 and %d\n",
+                MAX_STRASSEN_LEVELS);
         return 1;
     }
-    np = atoi(argv[1]);
-    nw = atoi(argv[2]);
-    max_job_created = atoi(argv[3]);
     if (np <= 0 || nw <= 0) {
         fprintf(stderr, "np and nw must be positive numbers\n");
         return 1;
     }
-    if (max_job_created < 2) {
-        fprintf(stderr, "Expected at least 2 matrices to multiply\n");
+    if (np > MAX_PRODUCERS) {
+        fprintf(stderr, "There can be at most %d producers\n", MAX_PRODUCERS);
         return 1;
     }
-
-    adjust_stack_size();
-
-    child_pids = calloc(nw, sizeof(*child_pids));
-
-    // Generate the shared memory segment
-    if ((shmid = shmget(IPC_PRIVATE, sizeof(struct shared_mem),
-                        IPC_CREAT | IPC_EXCL | 0644)) < 0) {
-        perror("Failed to shmget");
+    if (nw > MAX_CONSUMERS) {
+        fprintf(stderr, "There can be at most %d consumers\n", MAX_CONSUMERS);
+        return 1;
+    }
+    num_consumers = nw;
+    // The log is written out a drained batch at a time
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    if (max_job_created < 2) {
+        fprintf(stderr, "Expected at least 2 matrices to multiply\n");
         return 1;
     }
-    main_mem = shared_mem_attach(shmid);
-    shared_mem_init(main_mem);
 
-    for (int i = 0; i < np; i++) {
-        cpid = fork();
-        if (cpid == 0) {
-            srand(gen_seed());
-            producer(i + 1, shmid);
-        }
-        if (cpid == -1) {
-            perror("Fork failed");
-            exit(1);
+    start_ns = now_ns();
+    if (threads) {
+        // Untouched until the workers fault their pages in
+        main_mem = shared_mem_map();
+        shared_mem_init(main_mem, np + nw);
+        workers = start_threads(main_mem, np, nw, &start);
+    } else {
+        // Generate the shared memory segment. The workers inherit the
+        // attachment when they are forked.
+        shmid = shared_mem_create();
+        main_mem = shared_mem_attach(shmid);
+        shared_mem_init(main_mem, np + nw);
+
+        for (int i = 0; i < np + nw; i++) {
+            cpid = fork();
+            if (cpid == 0) {
+                worker_process(i < np ? i + 1 : i - np + 1, i >= np, main_mem);
+            }
+            if (cpid == -1) {
+                perror("Fork failed");
+                exit(1);
+            }
         }
     }
 
-    for (int i = 0; i < nw; i++) {
-        cpid = fork();
-        if (cpid == 0) {
-            srand(gen_seed());
-            consumer(i + 1, shmid);
-        }
-        if (cpid == -1) {
-            perror("Fork failed");
-            exit(1);
+    // Drain the log while waiting for the last product, and then until
+    // every producer and consumer has written its last record
+    pthread_mutex_lock(&main_mem->queue.lock);
+    while (!main_mem->queue.done) {
+        pthread_mutex_unlock(&main_mem->queue.lock);
+        drained = log_drain(&main_mem->log);
+        pthread_mutex_lock(&main_mem->queue.lock);
+        if (drained == 0 && !main_mem->queue.done) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_DRAIN_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&main_mem->queue.all_done,
+                                   &main_mem->queue.lock, &deadline);
         }
-        child_pids[i] = cpid;
     }
+    pthread_mutex_unlock(&main_mem->queue.lock);
+    end_ns = now_ns();
 
-    start_time = time(NULL);
-    for (;;) {
-        pthread_mutex_lock(&main_mem->cntr_lock);
-        if (main_mem->job_created == max_job_created) {
-            pthread_mutex_unlock(&main_mem->cntr_lock);
-            if (queue_cnt(&main_mem->queue) == 1) break;
-        }
-        pthread_mutex_unlock(&main_mem->cntr_lock);
-        sleep(1);
+    while (atomic_load(&main_mem->log.writers) > 0) {
+        if (log_drain(&main_mem->log) == 0) usleep(LOG_DRAIN_MS * 1000);
     }
-    end_time = time(NULL);
+    log_drain(&main_mem->log);
 
-    for (int i = 0; i < nw; i++) {
-        kill(child_pids[i], SIGTERM);
+    // Producers and consumers exit by themselves once done is set
+    if (threads) {
+        for (int i = 0; i < np + nw; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        pthread_barrier_destroy(&start);
+        free(workers);
+    } else {
+        while (wait(NULL) > 0)
+            ;
     }
 
     printf("\nSum along principal diagonal of result = %ld\n",
-           trace((long *)main_mem->queue.jobs[0].matrix));
-    print_time_taken(end_time - start_time);
+           trace(job_matrix(queue_first(&main_mem->queue)),
+                 queue_first(&main_mem->queue)->width));
+    print_time_taken(end_ns - start_ns);
+    print_dtlb_misses(main_mem, threads);
+
+    if (report_path) {
+        if (strcmp(report_path, "-") == 0) {
+            write_report(stdout, main_mem, np, nw, threads, start_ns, end_ns);
+        } else if ((report = fopen(report_path, "w"))) {
+            write_report(report, main_mem, np, nw, threads, start_ns, end_ns);
+            fclose(report);
+        } else {
+            perror("Failed to open the report");
+        }
+    }
 
-    shared_mem_release(main_mem);
-    free(child_pids);
+    if (threads)
+        munmap(main_mem, shared_mem_size());
+    else
+        shared_mem_release(main_mem);
     return 0;
 }
 
-void print_time_taken(time_t tot_time) {
-    long min, secs;
-    min = tot_time / 60L;
-    secs = tot_time % 60L;
+void worker_process(int id, bool is_consumer, struct shared_mem *mem) {
+    rand_state = gen_seed();
+    if (is_consumer)
+        consumer(id, mem);
+    else
+        producer(id, mem);
+    shared_mem_release(mem);
+    exit(0);
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *worker = arg;
+
+    rand_state = gen_seed();
+    if (worker->consumer) first_touch(worker->mem, worker->id);
+    pthread_barrier_wait(worker->start);
+
+    if (worker->consumer)
+        consumer(worker->id, worker->mem);
+    else
+        producer(worker->id, worker->mem);
+    return NULL;
+}
+
+// Starts the consumers and then the producers, pinned in turn to the CPUs
+// of the program's affinity mask. They wait on start, which is initialised
+// here, until every consumer has touched its pages.
+struct worker *start_threads(struct shared_mem *mem, int np, int nw,
+                             pthread_barrier_t *start) {
+    struct worker *workers;
+    pthread_attr_t attr;
+    cpu_set_t allowed, cpu;
+    int cpus[CPU_SETSIZE], ncpus = 0, err;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("Failed to sched_getaffinity");
+        exit(1);
+    }
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed)) cpus[ncpus++] = c;
+    }
+
+    if (!(workers = calloc(np + nw, sizeof(*workers)))) {
+        unreachable("Failed to allocate the workers");
+    }
+    pthread_barrier_init(start, NULL, np + nw);
+
+    for (int i = 0; i < np + nw; i++) {
+        workers[i].consumer = i < nw;
+        workers[i].id = i < nw ? i + 1 : i - nw + 1;
+        workers[i].mem = mem;
+        workers[i].start = start;
+
+        CPU_ZERO(&cpu);
+        CPU_SET(cpus[i % ncpus], &cpu);
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+        err = pthread_create(&workers[i].thread, &attr, worker_thread,
+                             &workers[i]);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            fprintf(stderr, "Failed to create a thread: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    return workers;
+}
+
+void print_time_taken(long long tot_ns) {
+    long min;
+    double secs;
+    min = tot_ns / 60000000000LL;
+    secs = (tot_ns % 60000000000LL) / 1e9;
     printf("Time taken: ");
     if (min > 0) printf("%ld min", min);
     if (min > 0 && secs > 0) printf(", ");
-    if (secs > 0) printf("%ld sec", secs);
+    if (secs > 0 || min == 0) printf("%.3f sec", secs);
     printf("\n");
 }
 
-long trace(long *matrix) {
+// What the segment ended up in, not what -H asked for
+static const char *backing_name(bool threads) {
+    switch (page_backing) {
+        case PAGES_HUGETLB:
+            return threads ? "MAP_HUGETLB huge pages"
+                           : "SHM_HUGETLB huge pages";
+        case PAGES_TRANSPARENT:
+            return "transparent huge pages";
+        default:
+            return "4 KB pages";
+    }
+}
+
+void print_dtlb_misses(struct shared_mem *mem, bool threads) {
+    int uncounted = atomic_load(&mem->dtlb_uncounted);
+    long long misses = atomic_load(&mem->dtlb_misses);
+    long long thp_kb = atomic_load(&mem->thp_kb);
+
+    printf("dTLB load misses of the consumers = ");
+    if (uncounted > 0)
+        printf("unknown, %d could not count theirs", uncounted);
+    else
+        printf("%lld", misses);
+    printf(" (segment in %s", backing_name(threads));
+    // Only advised, the kernel may have given any part of it or none
+    if (page_backing == PAGES_TRANSPARENT && thp_kb >= 0)
+        printf(", %lld of %zu MB of it huge", thp_kb >> 10,
+               shared_mem_size() >> 20);
+    printf(")\n");
+
+    if (dtlb_baseline >= 0 && uncounted == 0 && page_backing != PAGES_NORMAL) {
+        printf("dTLB load misses with 4 KB pages = %lld, %.3f times as many "
+               "with huge pages\n",
+               dtlb_baseline,
+               dtlb_baseline > 0 ? (double)misses / dtlb_baseline : 0.0);
+    }
+}
+
+static const char *phase_names[PHASES] = {
+    "generate", "queue_wait", "lock_wait", "copy", "multiply", "accumulate"};
+static const char *lock_names[LOCK_KINDS] = {"queue", "block"};
+
+static void report_locks(FILE *out, const struct lock_stats *locks) {
+    fprintf(out, "{");
+    for (int l = 0; l < LOCK_KINDS; l++) {
+        fprintf(out,
+                "%s\"%s\": {\"acquired\": %lld, \"contended\": %lld, "
+                "\"wait_ns\": %lld}",
+                l > 0 ? ", " : "", lock_names[l], locks[l].acquired,
+                locks[l].contended, locks[l].wait_ns);
+    }
+    fprintf(out, "}");
+}
+
+// One entry of the producers or consumers arrays. Utilization is the share
+// of its life a worker spent neither waiting on the queue nor for a lock.
+static void report_workers(FILE *out, const char *name,
+                           const struct worker_stats *workers, int n,
+                           const char *items) {
+    const struct worker_stats *w;
+    long long life;
+
+    fprintf(out, "  \"%s\": [\n", name);
+    for (int i = 0; i < n; i++) {
+        w = &workers[i];
+        life = w->end_ns - w->start_ns;
+        fprintf(out, "    {\"id\": %d, \"life_ns\": %lld, ", i + 1, life);
+        fprintf(out, "\"utilization\": %.4f, ",
+                life > 0 ? 1.0 - (double)(w->ns[PHASE_QUEUE_WAIT] +
+                                          w->ns[PHASE_LOCK_WAIT]) /
+                                     life
+                         : 0.0);
+        fprintf(out, "\"%s\": %lld, \"gops\": %.3f,\n", items, w->items,
+                w->ns[PHASE_MULTIPLY] > 0 ? w->ops / w->ns[PHASE_MULTIPLY]
+                                          : 0.0);
+        fprintf(out, "     \"phases_ns\": {");
+        for (int p = 0; p < PHASES; p++) {
+            fprintf(out, "%s\"%s\": %lld", p > 0 ? ", " : "", phase_names[p],
+                    w->ns[p]);
+        }
+        fprintf(out, "},\n     \"locks\": ");
+        report_locks(out, w->locks);
+        fprintf(out, "}%s\n", i + 1 < n ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+}
+
+// JSON summary of a run, meant for sizing np and nw. The critical path is
+// split into waiting for the first job, the span over which jobs were
+// published, during which the products were built as their operands came,
+// and the tail after the last one, which only the consumers can shorten.
+// Over the whole run, producer_bound is the share of the consumers' time
+// spent waiting for work.
+void write_report(FILE *out, struct shared_mem *mem, int np, int nw,
+                  bool threads, long long start_ns, long long end_ns) {
+    struct queue *queue = &mem->queue;
+    struct lock_stats locks[LOCK_KINDS] = {{0}};
+    long long wall = end_ns - start_ns, idle = 0, life = 0;
+    double ops = 0;
+
+    for (int i = 0; i < nw; i++) {
+        ops += mem->consumers[i].ops;
+        idle += mem->consumers[i].ns[PHASE_QUEUE_WAIT];
+        life += mem->consumers[i].end_ns - mem->consumers[i].start_ns;
+    }
+    for (int i = 0; i < np + nw; i++) {
+        const struct worker_stats *w =
+            i < np ? &mem->producers[i] : &mem->consumers[i - np];
+        for (int l = 0; l < LOCK_KINDS; l++) {
+            locks[l].acquired += w->locks[l].acquired;
+            locks[l].contended += w->locks[l].contended;
+            locks[l].wait_ns += w->locks[l].wait_ns;
+        }
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out,
+            "  \"config\": {\"np\": %d, \"nw\": %d, \"matrices\": %d, "
+            "\"mat_size\": %d, \"grid\": %d, \"strassen_levels\": %d, "
+            "\"threads\": %s, \"huge_pages\": %s},\n",
+            np, nw, max_job_created, mat_size, grid, strassen_levels,
+            threads ? "true" : "false", huge_pages ? "true" : "false");
+    fprintf(out, "  \"wall_ns\": %lld,\n", wall);
+    fprintf(out, "  \"gops\": %.3f,\n", wall > 0 ? ops / wall : 0.0);
+    fprintf(out,
+            "  \"critical_path_ns\": {\"first_job\": %lld, "
+            "\"publishing\": %lld, \"tail\": %lld},\n",
+            queue->first_publish_ns - start_ns,
+            queue->last_publish_ns - queue->first_publish_ns,
+            queue->done_ns - queue->last_publish_ns);
+    fprintf(out, "  \"producer_bound\": %.4f,\n",
+            life > 0 ? (double)idle / life : 0.0);
+    fprintf(out, "  \"locks\": ");
+    report_locks(out, locks);
+    fprintf(out, ",\n");
+    report_workers(out, "producers", mem->producers, np, "jobs");
+    report_workers(out, "consumers", mem->consumers, nw, "tasks");
+    fprintf(out, "  \"page_backing\": \"%s\",\n",
+            page_backing == PAGES_HUGETLB       ? "hugetlb"
+            : page_backing == PAGES_TRANSPARENT ? "thp"
+                                                : "4k");
+    fprintf(out, "  \"thp_kb\": ");
+    if (page_backing == PAGES_TRANSPARENT && atomic_load(&mem->thp_kb) >= 0)
+        fprintf(out, "%lld,\n", atomic_load(&mem->thp_kb));
+    else
+        fprintf(out, "null,\n");
+    fprintf(out, "  \"dtlb_baseline\": ");
+    if (dtlb_baseline >= 0)
+        fprintf(out, "%lld,\n", dtlb_baseline);
+    else
+        fprintf(out, "null,\n");
+    fprintf(out, "  \"dtlb_misses\": ");
+    if (atomic_load(&mem->dtlb_uncounted) > 0)
+        fprintf(out, "null\n");
+    else
+        fprintf(out, "%lld\n", atomic_load(&mem->dtlb_misses));
+    fprintf(out, "}\n");
+}
+
+long trace(const void *matrix, int width) {
     long sum = 0;
-    for (int i = 0; i < MAT_SIZE; i++) {
-        for (int j = 0; j < MAT_SIZE; j++) {
-            sum += matrix[i * MAT_SIZE + j];
+    for (int i = 0; i < mat_size; i++) {
+        for (int j = 0; j < mat_size; j++) {
+            sum += elem_get(matrix, width, (size_t)i * mat_size + j);
         }
     }
     return sum;
 }
 
-int rand_range(int min, int max) { return rand() % (max - min + 1) + min; }
+// Bound of the elements of a generated matrix
+uint64_t leaf_bound() {
+    return MAT_EL_MAX > -MAT_EL_MIN ? MAT_EL_MAX : -MAT_EL_MIN;
+}
+
+// Bound of the elements of a product of matrices with the given bounds,
+// saturating at UINT64_MAX
+uint64_t product_bound(uint64_t left, uint64_t right) {
+    uint64_t bound;
+
+    if (__builtin_mul_overflow(left, right, &bound) ||
+        __builtin_mul_overflow(bound, (uint64_t)mat_size, &bound)) {
+        return UINT64_MAX;
+    }
+    return bound;
+}
+
+int width_for(uint64_t bound) {
+    if (!narrow || bound > INT32_MAX) return 8;
+    return bound > INT16_MAX ? 4 : 2;
+}
+
+// Widest storage any job of the run needs, the one of the product of all
+// of them, which bounds the product of any run of consecutive ones. Worked
+// out on the first call, as buffer_count is called in loops.
+int max_width() {
+    static int width;
+    uint64_t leaf = leaf_bound();
+    uint64_t bound = leaf;
+
+    if (width) return width;
+    // Anything past INT32_MAX takes int64
+    for (int i = 1; i < max_job_created && bound <= INT32_MAX; i++) {
+        bound = product_bound(bound, leaf);
+    }
+    width = width_for(bound);
+    return width;
+}
+
+// Number of matrix buffers of each width in the segment. A job takes one
+// of its own width with its slot and gives it back with it. A product of
+// k leaves has the bound leaf^k * mat_size^(k - 1) however it was paired,
+// so the fewest leaves a product of some width covers caps how many such
+// products there are at once: the jobs in the chain cover distinct leaves
+// and so do the products being built. If those caps add up to more than
+// QUEUE_SIZE buffers of max_width(), as in long runs where most products
+// need int64 anyway, every job takes one of those instead.
+static int buffers[NUM_WIDTHS];
+static bool uniform_buffers;
+
+static void buffer_layout() {
+    static bool done;
+    uint64_t leaf = leaf_bound();
+    uint64_t bound = leaf;
+    int fewest[NUM_WIDTHS] = {0};
+    int widest = width_index(max_width());
+    size_t bytes = 0;
+
+    if (done) return;
+    done = true;
+
+    buffers[width_index(width_for(leaf))] =
+        max_job_created < MAX_INSERT_JOBS ? max_job_created : MAX_INSERT_JOBS;
+    for (int k = 2; k <= max_job_created; k++) {
+        bound = product_bound(bound, leaf);
+        int i = width_index(width_for(bound));
+        if (fewest[i] == 0) fewest[i] = k;
+        if (i == NUM_WIDTHS - 1) break;
+    }
+    for (int i = 0; i < NUM_WIDTHS; i++) {
+        if (fewest[i] > 0) {
+            int most = max_job_created / fewest[i];
+            int products = (most < MAX_INSERT_JOBS ? most : MAX_INSERT_JOBS) +
+                           (most < MAX_PRODUCTS ? most : MAX_PRODUCTS);
+            buffers[i] += products < max_job_created - 1
+                              ? products
+                              : max_job_created - 1;
+        }
+        if (buffers[i] > QUEUE_SIZE) buffers[i] = QUEUE_SIZE;
+        bytes += buffers[i] * buffer_bytes(i);
+    }
+    if (bytes > QUEUE_SIZE * buffer_bytes(widest)) {
+        memset(buffers, 0, sizeof(buffers));
+        buffers[widest] = QUEUE_SIZE;
+        uniform_buffers = true;
+    }
+}
+
+int buffer_count(int index) {
+    buffer_layout();
+    return buffers[index];
+}
+
+// Index of the buffers jobs of the given width are kept in
+static int buffer_index(int width) {
+    buffer_layout();
+    return uniform_buffers ? width_index(max_width()) : width_index(width);
+}
+
+int rand_range(int min, int max) {
+    return rand_r(&rand_state) % (max - min + 1) + min;
+}
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+void prng_seed(struct prng *prng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        for (int l = 0; l < PRNG_LANES; l++) {
+            prng->s[i][l] = splitmix64(&seed);
+        }
+    }
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// Fills dest with n elements of width bytes uniform in
+// [MAT_EL_MIN, MAT_EL_MAX]. Each
+// 64 bit output gives 4 elements, by scaling its 16 bit quarters.
+__attribute__((target_clones("arch=skylake-avx512", "avx2", "default")))
+void prng_fill(struct prng *prng, void *dest, int width, size_t n) {
+    const uint64_t range = MAT_EL_MAX - MAT_EL_MIN + 1;
+    uint64_t out[PRNG_LANES], t;
+    long els[4 * PRNG_LANES];
+    size_t cnt;
+
+    while (n > 0) {
+        for (int l = 0; l < PRNG_LANES; l++) {
+            out[l] = rotl(prng->s[1][l] * 5, 7) * 9;
+            t = prng->s[1][l] << 17;
+            prng->s[2][l] ^= prng->s[0][l];
+            prng->s[3][l] ^= prng->s[1][l];
+            prng->s[1][l] ^= prng->s[2][l];
+            prng->s[0][l] ^= prng->s[3][l];
+            prng->s[2][l] ^= t;
+            prng->s[3][l] = rotl(prng->s[3][l], 45);
+        }
+        for (int q = 0; q < 4; q++) {
+            for (int l = 0; l < PRNG_LANES; l++) {
+                els[q * PRNG_LANES + l] =
+                    (long)((((out[l] >> (16 * q)) & 0xffff) * range) >> 16) +
+                    MAT_EL_MIN;
+            }
+        }
+        cnt = n < 4 * PRNG_LANES ? n : 4 * PRNG_LANES;
+        for (size_t i = 0; i < cnt; i++) {
+            elem_set(dest, width, i, els[i]);
+        }
+        dest = (char *)dest + cnt * width;
+        n -= cnt;
+    }
+}
 
 int gen_seed() {
     int fd, res;
@@ -222,378 +1067,1274 @@ int gen_seed() {
     return res;
 }
 
-void producer(int prod_id, int shmid) {
-    struct shared_mem *mem;
-    struct job job;
-    int mat_id, wait_sec;
+void producer(int prod_id, struct shared_mem *mem) {
+    struct job *job;
+    struct prng prng;
+    int slot;
+    long long start;
+    struct log_record *record;
 
-    mem = shared_mem_attach(shmid);
+    worker_stats = &mem->producers[prod_id - 1];
+    worker_stats->start_ns = now_ns();
+    worker_log = &mem->log;
+    prng_seed(&prng, (uint64_t)rand_r(&rand_state) << 32 |
+                         (uint32_t)rand_r(&rand_state));
 
     for (;;) {
-        mat_id = rand_range(MAT_ID_MIN, MAT_ID_MAX);
-        job_init(&job, prod_id, mat_id);
-
-        wait_sec = rand() % 3;
-        sleep(wait_sec);
-
-        if (queue_push(&mem->queue, &job, mem)) {
-            printf("Produced: ");
-            job_print(&job);
+        if (max_prod_delay_ms > 0) {
+            usleep(rand_range(0, max_prod_delay_ms) * 1000L);
         }
-        pthread_mutex_lock(&mem->cntr_lock);
-        if (mem->job_created == max_job_created) {
-            pthread_mutex_unlock(&mem->cntr_lock);
-            break;
+
+        // Blocks while the queue is full, fails once every job is created
+        if ((slot = queue_reserve(&mem->queue, mem)) == -1) break;
+
+        // The slot is ours until it is published, so the matrix is
+        // generated in place without holding any lock
+        job = mem->queue.jobs + slot;
+        start = now_ns();
+        job_init(job, prod_id, rand_range(MAT_ID_MIN, MAT_ID_MAX), &prng);
+        worker_stats->ns[PHASE_GENERATE] += now_ns() - start;
+        worker_stats->items++;
+        if ((record = log_begin(LOG_PRODUCED))) {
+            record->worker = prod_id;
+            record->prod_id = job->prod_num;
+            record->mat_id = job->mat_id;
+            record->a = slot;
+            log_commit(record);
         }
-        pthread_mutex_unlock(&mem->cntr_lock);
+
+        queue_publish(&mem->queue, slot);
     }
+    worker_stats->end_ns = now_ns();
+    atomic_fetch_sub(&worker_log->writers, 1);
+}
 
-    shared_mem_release(mem);
-    exit(0);
+// Rows (or columns) of block b of the grid, the last ones getting the
+// remainder of mat_size / grid
+void block_range(int b, int *start, int *end) {
+    *start = (int)((long)b * mat_size / grid);
+    *end = (int)((long)(b + 1) * mat_size / grid);
 }
 
-void copy_block(long *dest, long *src, int i, int j) {
-    int dest_size = MAT_SIZE / 2, src_size = MAT_SIZE;
-    int row_start, row_end, col_start, col_end, idx;
+struct block_id task_to_block_id(int task) {
+    return (struct block_id){task / (grid * grid), (task / grid) % grid,
+                             task % grid};
+}
 
-    row_start = (i == 0 ? 0 : dest_size);
-    row_end = (i == 0 ? dest_size : src_size);
-    col_start = (j == 0 ? 0 : dest_size);
-    col_end = (j == 0 ? dest_size : src_size);
+void copy_back_block(void *dest, int dest_width, const void *src,
+                     int src_width, int i, int j) {
+    int row_start, row_end, col_start, col_end;
+    size_t idx;
+
+    block_range(i, &row_start, &row_end);
+    block_range(j, &col_start, &col_end);
 
     idx = 0;
     for (int row = row_start; row < row_end; row++) {
         for (int col = col_start; col < col_end; col++) {
-            dest[idx] = src[row * src_size + col];
+            elem_set(dest, dest_width, (size_t)row * mat_size + col,
+                     elem_get(src, src_width, idx));
             idx++;
         }
     }
 }
 
-void copy_back_block(long *dest, long *src, int i, int j) {
-    int dest_size = MAT_SIZE, src_size = MAT_SIZE / 2;
-    int row_start, row_end, col_start, col_end, idx;
+void add_back_block(void *dest, int dest_width, const void *src,
+                    int src_width, int i, int j) {
+    int row_start, row_end, col_start, col_end;
+    size_t idx, at;
 
-    row_start = (i == 0 ? 0 : src_size);
-    row_end = (i == 0 ? src_size : dest_size);
-    col_start = (j == 0 ? 0 : src_size);
-    col_end = (j == 0 ? src_size : dest_size);
+    block_range(i, &row_start, &row_end);
+    block_range(j, &col_start, &col_end);
 
     idx = 0;
     for (int row = row_start; row < row_end; row++) {
         for (int col = col_start; col < col_end; col++) {
-            dest[row * dest_size + col] = src[idx];
+            at = (size_t)row * mat_size + col;
+            elem_set(dest, dest_width, at,
+                     elem_get(dest, dest_width, at) +
+                         elem_get(src, src_width, idx));
             idx++;
         }
     }
 }
 
-void add_back_block(long *dest, long *src, int i, int j) {
-    int dest_size = MAT_SIZE, src_size = MAT_SIZE / 2;
-    int row_start, row_end, col_start, col_end, idx;
+// Blocking of block_multiply. A MM_KC x MM_NC panel of right and a
+// MM_MC x MM_KC panel of left are packed into contiguous slivers, NR
+// columns and MM_MR rows wide, which the micro-kernel streams through
+// while it keeps an MM_MR x NR tile of the result in vector registers.
+// Packing also widens narrower inputs to the type the product is
+// computed in.
+#define MM_MR 4
+#define MM_KC 256
+#define MM_MC 64
+#define MM_NC 512
+
+// Packing buffers of each thread, big enough for any element type
+static __thread void *packed_buf;
+
+static inline int min_int(int a, int b) { return a < b ? a : b; }
+
+// Defines block_multiply_<bits>, computing in int<bits>_t with a
+// micro-kernel nr elements wide. Every input has to fit the type.
+#define DEFINE_BLOCK_MULTIPLY(bits, nr)                                       \
+    typedef int##bits##_t mm_vec##bits                                        \
+        __attribute__((vector_size(nr * sizeof(int##bits##_t))));            \
+                                                                              \
+    static inline void pack_left_##bits(int##bits##_t *dest, const void *src, \
+                                        int width, int ld, int m, int k) {    \
+        for (int i = 0; i < m; i += MM_MR) {                                  \
+            for (int p = 0; p < k; p++) {                                     \
+                for (int r = 0; r < MM_MR; r++) {                             \
+                    *dest++ = (i + r < m ? elem_get(src, width,               \
+                                                    (size_t)(i + r) * ld + p) \
+                                         : 0);                                \
+                }                                                             \
+            }                                                                 \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    static inline void pack_right_##bits(int##bits##_t *dest,                 \
+                                         const void *src, int width, int ld,  \
+                                         int k, int n) {                      \
+        for (int j = 0; j < n; j += nr) {                                     \
+            for (int p = 0; p < k; p++) {                                     \
+                for (int c = 0; c < nr; c++) {                                \
+                    *dest++ = (j + c < n ? elem_get(src, width,               \
+                                                    (size_t)p * ld + j + c)   \
+                                         : 0);                                \
+                }                                                             \
+            }                                                                 \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    /* One accumulator per row of the MM_MR (4) high tile. Always inlined,   \
+       so each clone of block_multiply_<bits> gets a copy built for its     \
+       own instruction set. */                                                \
+    static inline __attribute__((always_inline)) void micro_kernel_##bits(    \
+        int##bits##_t *result, int ld, const int##bits##_t *left,             \
+        const int##bits##_t *right, int k, int m, int n) {                    \
+        mm_vec##bits acc0 = {0}, acc1 = {0}, acc2 = {0}, acc3 = {0}, row;     \
+                                                                              \
+        for (int p = 0; p < k; p++) {                                         \
+            memcpy(&row, right + p * nr, sizeof(row));                        \
+            acc0 += left[p * MM_MR + 0] * row;                                \
+            acc1 += left[p * MM_MR + 1] * row;                                \
+            acc2 += left[p * MM_MR + 2] * row;                                \
+            acc3 += left[p * MM_MR + 3] * row;                                \
+        }                                                                     \
+                                                                              \
+        mm_vec##bits acc[MM_MR] = {acc0, acc1, acc2, acc3};                   \
+                                                                              \
+        if (m == MM_MR && n == nr) {                                          \
+            for (int r = 0; r < MM_MR; r++) {                                 \
+                memcpy(&row, result + r * ld, sizeof(row));                   \
+                row += acc[r];                                                \
+                memcpy(result + r * ld, &row, sizeof(row));                   \
+            }                                                                 \
+        } else {                                                              \
+            for (int r = 0; r < m; r++) {                                     \
+                for (int c = 0; c < n; c++) {                                 \
+                    result[r * ld + c] += acc[r][c];                          \
+                }                                                             \
+            }                                                                 \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    __attribute__((target_clones("arch=skylake-avx512", "avx2", "default")))  \
+    void block_multiply_##bits(                                               \
+        int##bits##_t *result, int ld_result, const void *left,               \
+        int left_width, int ld_left, const void *right, int right_width,      \
+        int ld_right, int m, int n, int k) {                                  \
+        int##bits##_t *packed_left = packed_buf;                              \
+        int##bits##_t *packed_right = packed_left + MM_MC * MM_KC;            \
+        int nc, kc, mc;                                                       \
+                                                                              \
+        for (int i = 0; i < m; i++) {                                         \
+            memset(result + i * ld_result, 0, n * sizeof(*result));           \
+        }                                                                     \
+                                                                              \
+        for (int jc = 0; jc < n; jc += MM_NC) {                               \
+            nc = min_int(MM_NC, n - jc);                                      \
+            for (int pc = 0; pc < k; pc += MM_KC) {                           \
+                kc = min_int(MM_KC, k - pc);                                  \
+                pack_right_##bits(                                            \
+                    packed_right,                                             \
+                    (const char *)right +                                     \
+                        ((size_t)pc * ld_right + jc) * right_width,           \
+                    right_width, ld_right, kc, nc);                           \
+                for (int ic = 0; ic < m; ic += MM_MC) {                       \
+                    mc = min_int(MM_MC, m - ic);                              \
+                    pack_left_##bits(packed_left,                             \
+                                     (const char *)left +                     \
+                                         ((size_t)ic * ld_left + pc) *        \
+                                             left_width,                      \
+                                     left_width, ld_left, mc, kc);            \
+                    for (int jr = 0; jr < nc; jr += nr) {                     \
+                        for (int ir = 0; ir < mc; ir += MM_MR) {              \
+                            micro_kernel_##bits(                              \
+                                result + (ic + ir) * ld_result + jc + jr,     \
+                                ld_result, packed_left + ir * kc,             \
+                                packed_right + jr * kc, kc,                   \
+                                min_int(MM_MR, mc - ir),                      \
+                                min_int(nr, nc - jr));                        \
+                        }                                                     \
+                    }                                                         \
+                }                                                             \
+            }                                                                 \
+        }                                                                     \
+    }
 
-    row_start = (i == 0 ? 0 : src_size);
-    row_end = (i == 0 ? src_size : dest_size);
-    col_start = (j == 0 ? 0 : src_size);
-    col_end = (j == 0 ? src_size : dest_size);
+DEFINE_BLOCK_MULTIPLY(32, 16)
+DEFINE_BLOCK_MULTIPLY(64, 8)
+
+// result = left * right, for an m x k left and a k x n right. Every matrix
+// is row-major with its own row stride and element width. The product is
+// computed in int32 or int64 according to width, which must hold every
+// element of the inputs and of the result. Compiled for AVX-512, AVX2 and
+// plain x86-64, the best one being picked when the program loads.
+void block_multiply(void *result, int width, int ld_result, const void *left,
+                    int left_width, int ld_left, const void *right,
+                    int right_width, int ld_right, int m, int n, int k) {
+    if (!packed_buf) {
+        packed_buf = aligned_alloc(64, (MM_MC * MM_KC + MM_KC * MM_NC) *
+                                           sizeof(int64_t));
+        if (!packed_buf) unreachable("Failed to allocate packing buffers");
+    }
 
-    idx = 0;
-    for (int row = row_start; row < row_end; row++) {
-        for (int col = col_start; col < col_end; col++) {
-            dest[row * dest_size + col] += src[idx];
-            idx++;
-        }
+    if (width == 4) {
+        block_multiply_32(result, ld_result, left, left_width, ld_left, right,
+                          right_width, ld_right, m, n, k);
+    } else {
+        block_multiply_64(result, ld_result, left, left_width, ld_left, right,
+                          right_width, ld_right, m, n, k);
     }
 }
 
-struct block_id {
-    int i;
-    int j;
-    int k;
-};
+// Frees the packing buffers of the calling thread. A worker thread has to,
+// as nothing frees thread locals when it exits.
+void block_multiply_release() {
+    free(packed_buf);
+    packed_buf = NULL;
+}
 
-struct block_id *job_status_to_block_id(enum job_status status) {
-    static struct block_id id;
-    switch (status) {
-        case ST_D000:
-            id = (struct block_id){0, 0, 0};
-            break;
-        case ST_D001:
-            id = (struct block_id){0, 0, 1};
-            break;
-        case ST_D010:
-            id = (struct block_id){0, 1, 0};
-            break;
-        case ST_D011:
-            id = (struct block_id){0, 1, 1};
-            break;
-        case ST_D100:
-            id = (struct block_id){1, 0, 0};
-            break;
-        case ST_D101:
-            id = (struct block_id){1, 0, 1};
-            break;
-        case ST_D110:
-            id = (struct block_id){1, 1, 0};
-            break;
-        case ST_D111:
-            id = (struct block_id){1, 1, 1};
-            break;
-        case ST_Complete:
-            id = (struct block_id){-1, -1, -1};
-            break;
-    }
-    return &id;
+// Counter of the dTLB load misses of the calling thread in user space, or
+// -1 if the CPU or perf_event_paranoid does not allow it
+int dtlb_counter_open() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                  PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
 }
 
-void block_multiply(long *result, long *left, long *right) {
-    int size = MAT_SIZE / 2;
-    long sum;
+// Takes lock, counting in the stats of the calling worker whether it had
+// to wait for it and for how long
+void stats_lock(pthread_mutex_t *lock, enum lock_kind kind) {
+    struct lock_stats *stats;
+    long long start, wait;
 
-    for (int i = 0; i < size; i++) {
-        for (int j = 0; j < size; j++) {
-            sum = 0;
-            for (int k = 0; k < size; k++) {
-                sum += left[i * size + k] * right[k * size + j];
-            }
-            result[i * size + j] = sum;
-        }
+    if (!worker_stats) {
+        pthread_mutex_lock(lock);
+        return;
     }
+    stats = &worker_stats->locks[kind];
+    stats->acquired++;
+    if (pthread_mutex_trylock(lock) == 0) return;
+
+    start = now_ns();
+    pthread_mutex_lock(lock);
+    wait = now_ns() - start;
+    stats->contended++;
+    stats->wait_ns += wait;
+    worker_stats->ns[PHASE_LOCK_WAIT] += wait;
 }
 
-void consumer_log(int cons_id, int prod_id, int mat_id, int i, int j,
-                  const char *mess) {
-    printf("In Consumer %d: ", cons_id);
-    if (prod_id > 0)
-        printf("Producer id = %d, ", prod_id);
-    else
-        printf("Producer id = %d (consumer), ", -prod_id);
-    printf("Matrix id = %d, ", mat_id);
-    printf("%s block (%d, %d)\n", mess, i, j);
+// Waits on cond, the time until lock is taken back counting as waiting on
+// the queue
+void stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock) {
+    long long start = now_ns();
+
+    pthread_cond_wait(cond, lock);
+    if (worker_stats) worker_stats->ns[PHASE_QUEUE_WAIT] += now_ns() - start;
 }
 
-void consumer(int cons_id, int shmid) {
-    struct shared_mem *mem;
-    struct job *left_job, *right_job, *result_job;
-    struct block_id *id;
-    enum job_status status, new_status;
-    long left_block[MAT_SIZE / 2][MAT_SIZE / 2];
-    long right_block[MAT_SIZE / 2][MAT_SIZE / 2];
-    long result_block[MAT_SIZE / 2][MAT_SIZE / 2];
-    int block_id;
-    enum block_status curr_block_status;
+double elapsed_sec(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    static const enum block_status all_blocks_done[] = {BS_Done, BS_Done,
-                                                        BS_Done, BS_Done};
+// Strassen-Winograd. A product is computed from 7 multiplications instead
+// of 8, of operands which are sums of the quadrants of its inputs, and the
+// 7 products are then summed into the quadrants of the result.
+// winograd_left[q] and winograd_right[q] give the coefficients of
+// quadrants 11, 12, 21 and 22 of left and right in the operands of
+// multiplication q, winograd_result[i][q] the one of product q in
+// quadrant i of the result. Odd sizes are padded with zeros, and the
+// integer arithmetic is exact modulo 2^64 like the classical one.
+static const signed char winograd_left[7][4] = {
+    {1, 0, 0, 0},   {0, 1, 0, 0}, {1, 1, -1, -1}, {0, 0, 0, 1},
+    {0, 0, 1, 1},   {-1, 0, 1, 1}, {1, 0, -1, 0},
+};
+static const signed char winograd_right[7][4] = {
+    {1, 0, 0, 0},   {0, 0, 1, 0},  {0, 0, 0, 1}, {1, -1, -1, 1},
+    {-1, 1, 0, 0},  {1, -1, 0, 1}, {0, -1, 0, 1},
+};
+static const signed char winograd_result[4][7] = {
+    {1, 1, 0, 0, 0, 0, 0},
+    {1, 0, 1, 0, 1, 1, 0},
+    {1, 0, 0, -1, 0, 1, 1},
+    {1, 0, 0, 0, 1, 1, 1},
+};
 
-    mem = shared_mem_attach(shmid);
+// Builds the h x h operand with the given quadrant coefficients out of the
+// s x s matrix src
+void winograd_operand(long *dest, int h, const void *src, int width, int ld,
+                      int s, const signed char coef[4]) {
+    int row, col;
+    long sum;
 
-    for (;;) {
-        while (queue_cnt(&mem->queue) < 2) {
-            sleep(1);
+    for (int r = 0; r < h; r++) {
+        for (int c = 0; c < h; c++) {
+            sum = 0;
+            for (int q = 0; q < 4; q++) {
+                row = (q / 2) * h + r;
+                col = (q % 2) * h + c;
+                if (coef[q] != 0 && row < s && col < s) {
+                    sum += coef[q] *
+                           elem_get(src, width, (size_t)row * ld + col);
+                }
+            }
+            dest[(size_t)r * h + c] = sum;
         }
+    }
+}
 
-        // Lock once to copy the data
-        pthread_mutex_lock(&mem->queue.lock);
-        left_job = mem->queue.jobs;
-        right_job = mem->queue.jobs + 1;
-        result_job = mem->queue.jobs + MAX_INSERT_JOBS;
-
-        assert(left_job->status == right_job->status);
-        status = left_job->status;
-        new_status = status + 1;
+// Sums the 7 h x h products at prods into quadrant i of the s x s dest
+void winograd_combine(void *dest, int width, int ld, int s, const long *prods,
+                      int h, int i) {
+    size_t hh = (size_t)h * h;
+    int row, col;
+    long sum;
 
-        if (status == ST_Complete) {
-            pthread_mutex_unlock(&mem->queue.lock);
-            sleep(1);
-            continue;
+    for (int r = 0; r < h && (row = (i / 2) * h + r) < s; r++) {
+        for (int c = 0; c < h && (col = (i % 2) * h + c) < s; c++) {
+            sum = 0;
+            for (int q = 0; q < 7; q++) {
+                sum += winograd_result[i][q] *
+                       prods[q * hh + (size_t)r * h + c];
+            }
+            elem_set(dest, width, (size_t)row * ld + col, sum);
         }
+    }
+}
 
-        id = job_status_to_block_id(status);
-        copy_block((long *)left_block, (long *)left_job->matrix, id->i, id->k);
-        consumer_log(cons_id, left_job->prod_num, left_job->mat_id, id->i,
-                     id->k, "Reading");
-        copy_block((long *)right_block, (long *)right_job->matrix, id->k,
-                   id->j);
-        consumer_log(cons_id, right_job->prod_num, right_job->mat_id, id->k,
-                     id->j, "Reading");
+// c = a * b for s x s matrices of long, going down levels of
+// Strassen-Winograd recursion before using block_multiply
+void strassen_multiply(long *c, int ldc, const long *a, int lda,
+                       const long *b, int ldb, int s, int levels) {
+    int h = (s + 1) / 2;
+    size_t hh = (size_t)h * h;
+    long *buf;
+
+    if (levels == 0 || s < STRASSEN_MIN_SIZE) {
+        block_multiply(c, 8, ldc, a, 8, lda, b, 8, ldb, s, s, s);
+        return;
+    }
 
-        left_job->status = right_job->status = new_status;
+    // Left operands, right operands and products, 7 of each
+    if (!(buf = malloc(21 * hh * sizeof(long)))) {
+        unreachable("Failed to allocate Strassen operands");
+    }
+    for (int q = 0; q < 7; q++) {
+        winograd_operand(buf + q * hh, h, a, 8, lda, s, winograd_left[q]);
+        winograd_operand(buf + (7 + q) * hh, h, b, 8, ldb, s,
+                         winograd_right[q]);
+    }
+    for (int q = 0; q < 7; q++) {
+        strassen_multiply(buf + (14 + q) * hh, h, buf + q * hh, h,
+                          buf + (7 + q) * hh, h, h, levels - 1);
+    }
+    for (int i = 0; i < 4; i++) {
+        winograd_combine(c, 8, ldc, s, buf + 14 * hh, h, i);
+    }
+    free(buf);
+}
 
-        result_job->prod_num = -cons_id;
-        result_job->mat_id = rand_range(MAT_ID_MIN, MAT_ID_MAX);
+// Times the classical kernel against 1 to 3 levels of Strassen-Winograd on
+// square matrices of growing size, to find where the latter starts paying
+int strassen_bench() {
+    static const int sizes[] = {64, 128, 256, 512, 1024, 2048};
+    struct prng prng;
+    struct timespec start;
+    long *a, *b, *c, *ref;
+    double classical, secs;
+    size_t elems;
+    int s;
+
+    prng_seed(&prng, 1);
+    printf("%6s %12s %12s %12s %12s\n", "size", "classical", "strassen-1",
+           "strassen-2", "strassen-3");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        s = sizes[i];
+        elems = (size_t)s * s;
+        a = aligned_alloc(64, elems * sizeof(long));
+        b = aligned_alloc(64, elems * sizeof(long));
+        c = aligned_alloc(64, elems * sizeof(long));
+        ref = aligned_alloc(64, elems * sizeof(long));
+        if (!a || !b || !c || !ref) unreachable("Failed to allocate");
+        prng_fill(&prng, a, 8, elems);
+        prng_fill(&prng, b, 8, elems);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        block_multiply(ref, 8, s, a, 8, s, b, 8, s, s, s, s);
+        classical = elapsed_sec(&start);
+        printf("%6d %10.1fms", s, classical * 1e3);
+
+        for (int levels = 1; levels <= 3; levels++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            strassen_multiply(c, s, a, s, b, s, s, levels);
+            secs = elapsed_sec(&start);
+            if (memcmp(c, ref, elems * sizeof(long)) != 0) {
+                unreachable("Strassen-Winograd gave a wrong product");
+            }
+            printf(" %8.1fms%s", secs * 1e3, secs < classical ? " *" : "  ");
+        }
+        printf("\n");
+        fflush(stdout);
+        free(a);
+        free(b);
+        free(c);
+        free(ref);
+    }
+    printf("* faster than the classical kernel\n");
+    return 0;
+}
 
-        pthread_mutex_unlock(&mem->queue.lock);
+void consumer_log(int cons_id, int prod_id, int mat_id, int i, int j,
+                  enum log_message mess) {
+    struct log_record *record;
+
+    if (!(record = log_begin(LOG_BLOCK))) return;
+    record->message = mess;
+    record->worker = cons_id;
+    record->prod_id = prod_id;
+    record->mat_id = mat_id;
+    record->a = i;
+    record->b = j;
+    log_commit(record);
+}
 
-        // Do the computation (super long)
-        block_multiply((long *)result_block, (long *)left_block,
-                       (long *)right_block);
+void strassen_log(int cons_id, int prod_id, int mat_id, enum log_message mess,
+                  int n) {
+    struct log_record *record;
+
+    if (!(record = log_begin(LOG_STRASSEN))) return;
+    record->message = mess;
+    record->worker = cons_id;
+    record->prod_id = prod_id;
+    record->mat_id = mat_id;
+    record->a = n;
+    log_commit(record);
+}
 
-        // Lock again to push in the data
-        pthread_mutex_lock(&mem->queue.lock);
+int product_tasks() {
+    return strassen_levels > 0 ? STRASSEN_TASKS : grid * grid * grid;
+}
 
-        block_id = 2 * id->i + id->j;
-        curr_block_status = result_job->blocks[block_id];
-        result_job->blocks[block_id]++;
+// Multiplies a block of left by one of right into result_block and adds
+// that into the result, taking block_locks[b] for its block b
+void block_task(int cons_id, int mat_id, struct job *left_job,
+                struct job *right_job, struct job *result_job,
+                pthread_mutex_t *block_locks, int task, void *result_block,
+                struct worker_stats *stats) {
+    struct block_id id;
+    const char *left, *right;
+    int block_id, row, col, inner, m, n, k, end, width;
+    enum log_message mess;
+    long long start;
+
+    id = task_to_block_id(task);
+    block_range(id.i, &row, &end);
+    m = end - row;
+    block_range(id.j, &col, &end);
+    n = end - col;
+    block_range(id.k, &inner, &end);
+    k = end - inner;
+
+    left = (char *)job_matrix(left_job) +
+           ((size_t)row * mat_size + inner) * left_job->width;
+    consumer_log(cons_id, left_job->prod_num, left_job->mat_id, id.i, id.k,
+                 MESS_READING);
+    right = (char *)job_matrix(right_job) +
+            ((size_t)inner * mat_size + col) * right_job->width;
+    consumer_log(cons_id, right_job->prod_num, right_job->mat_id, id.k, id.j,
+                 MESS_READING);
+
+    // Do the computation (super long)
+    start = now_ns();
+    // Computed at least in int32, whatever the result is stored in
+    width = result_job->width < 4 ? 4 : result_job->width;
+    block_multiply(result_block, width, n, left, left_job->width, mat_size,
+                   right, right_job->width, mat_size, m, n, k);
+    stats->ns[PHASE_MULTIPLY] += now_ns() - start;
+    stats->ops += 2.0 * m * n * k;
+
+    // The first of the grid products for a result block is copied in, the
+    // others are added to it
+    block_id = id.i * grid + id.j;
+    stats_lock(&block_locks[block_id], LOCK_BLOCK);
+    start = now_ns();
+    if (result_job->blocks[block_id] == 0) {
+        copy_back_block(job_matrix(result_job), result_job->width,
+                        result_block, width, id.i, id.j);
+        stats->ns[PHASE_COPY] += now_ns() - start;
+        mess = MESS_COPYING;
+    } else if (result_job->blocks[block_id] < grid) {
+        add_back_block(job_matrix(result_job), result_job->width,
+                       result_block, width, id.i, id.j);
+        stats->ns[PHASE_ACCUMULATE] += now_ns() - start;
+        mess = MESS_ADDING;
+    } else {
+        unreachable("Result block cannot have more than grid products");
+    }
+    result_job->blocks[block_id]++;
+    pthread_mutex_unlock(&block_locks[block_id]);
+    consumer_log(cons_id, result_job->prod_num, mat_id, id.i, id.j, mess);
+}
 
-        if (curr_block_status == BS_Assign) {
-            copy_back_block((long *)result_job->matrix, (long *)result_block,
-                            id->i, id->j);
-            consumer_log(cons_id, result_job->prod_num, result_job->mat_id,
-                         id->i, id->j, "Copying");
-        } else if (curr_block_status == BS_Add) {
-            add_back_block((long *)result_job->matrix, (long *)result_block,
-                           id->i, id->j);
-            consumer_log(cons_id, result_job->prod_num, result_job->mat_id,
-                         id->i, id->j, "Adding");
+// Runs one task of a Strassen-Winograd product, whose factors and
+// products are kept in temp. Every task writes a part of its own, so
+// none needs a lock.
+void strassen_task(int cons_id, int mat_id, struct job *left_job,
+                   struct job *right_job, struct job *result_job, long *temp,
+                   int task, struct worker_stats *stats) {
+    int h = (mat_size + 1) / 2;
+    size_t hh = (size_t)h * h;
+    long long start = now_ns();
+    int q;
+
+    if (task < 7) {
+        winograd_operand(temp + task * hh, h, job_matrix(left_job),
+                         left_job->width, mat_size, mat_size,
+                         winograd_left[task]);
+        stats->ns[PHASE_COPY] += now_ns() - start;
+        strassen_log(cons_id, left_job->prod_num, left_job->mat_id,
+                     MESS_LEFT_FACTOR, task);
+    } else if (task < STRASSEN_MULTIPLY_TASK) {
+        q = task - 7;
+        winograd_operand(temp + task * hh, h, job_matrix(right_job),
+                         right_job->width, mat_size, mat_size,
+                         winograd_right[q]);
+        stats->ns[PHASE_COPY] += now_ns() - start;
+        strassen_log(cons_id, right_job->prod_num, right_job->mat_id,
+                     MESS_RIGHT_FACTOR, q);
+    } else if (task < STRASSEN_COMBINE_TASK) {
+        q = task - STRASSEN_MULTIPLY_TASK;
+        strassen_multiply(temp + (STRASSEN_MULTIPLY_TASK + q) * hh, h,
+                          temp + q * hh, h, temp + (7 + q) * hh, h, h,
+                          strassen_levels - 1);
+        stats->ns[PHASE_MULTIPLY] += now_ns() - start;
+        // Counted as the classical product would be
+        stats->ops += 2.0 * h * h * h;
+        strassen_log(cons_id, result_job->prod_num, mat_id, MESS_MULTIPLYING,
+                     q);
+    } else {
+        q = task - STRASSEN_COMBINE_TASK;
+        winograd_combine(job_matrix(result_job), result_job->width, mat_size,
+                         mat_size, temp + STRASSEN_MULTIPLY_TASK * hh, h, q);
+        stats->ns[PHASE_ACCUMULATE] += now_ns() - start;
+        strassen_log(cons_id, result_job->prod_num, mat_id, MESS_QUADRANT, q);
+    }
+}
+
+void consumer(int cons_id, struct shared_mem *mem) {
+    struct job *left_job, *right_job, *result_job;
+    void *result_block;
+    long *temp;
+    int task, result, done, dtlb_fd;
+    int max_block;
+    struct worker_stats *stats = &mem->consumers[cons_id - 1];
+    long long dtlb_misses;
+    struct log_record *record;
+
+    worker_stats = stats;
+    stats->start_ns = now_ns();
+    worker_log = &mem->log;
+
+    // Reused for every task, and aligned for the vector stores. The
+    // Strassen-Winograd tasks multiply straight into temp and need none.
+    result_block = NULL;
+    if (strassen_levels == 0) {
+        max_block = (mat_size + grid - 1) / grid;
+        result_block = aligned_alloc(
+            64,
+            ((size_t)max_block * max_block * sizeof(long) + 63) & ~(size_t)63);
+        if (!result_block) {
+            unreachable("Failed to allocate the consumer's result block");
+        }
+    }
+    dtlb_fd = dtlb_counter_open();
+
+    // Waits for a task, until there are none left. The slot of a product
+    // is not relinked before all of its tasks are done, so it can be read
+    // without the lock.
+    while ((result = queue_next_task(&mem->queue, cons_id, &task)) != -1) {
+        left_job = mem->queue.jobs + mem->queue.slots[result].left;
+        right_job = mem->queue.jobs + mem->queue.slots[result].right;
+        result_job = mem->queue.jobs + result;
+        temp = queue_temp(&mem->queue, mem->queue.slots[result].temp);
+
+        if (strassen_levels > 0) {
+            strassen_task(cons_id, result_job->mat_id, left_job, right_job,
+                          result_job, temp, task, stats);
         } else {
-            unreachable("curr_block_status cannot be BS_Done");
+            block_task(cons_id, result_job->mat_id, left_job, right_job,
+                       result_job, mem->queue.block_locks[result], task,
+                       result_block, stats);
         }
-
-        // Check if all blocks are done
-        // Then pop top 2, rotate right once, adjust cnt
-        if (memcmp(result_job->blocks, all_blocks_done,
-                   sizeof(all_blocks_done)) == 0) {
-            queue_pop(&mem->queue);
-            queue_pop(&mem->queue);
-            queue_rotate_right(&mem->queue, 1);
-            memset(result_job, 0, sizeof(*result_job));
-            queue_incr_cnt(&mem->queue);
+        stats->items++;
+
+        // The last task to finish puts the product in the chain, and the
+        // last one of a Strassen-Winograd phase lets the next one start
+        done = atomic_fetch_add(&result_job->tasks_done, 1) + 1;
+        if (done == product_tasks()) {
+            // Logged first, as the operands' slots are then freed
+            if ((record = log_begin(LOG_PRODUCT))) {
+                record->worker = cons_id;
+                record->prod_id = result_job->prod_num;
+                record->mat_id = result_job->mat_id;
+                record->a = left_job->mat_id;
+                record->b = right_job->mat_id;
+                log_commit(record);
+            }
+            queue_product_done(&mem->queue, result, mem);
+        } else if (strassen_levels > 0 && (done == STRASSEN_MULTIPLY_TASK ||
+                                           done == STRASSEN_COMBINE_TASK)) {
+            stats_lock(&mem->queue.lock, LOCK_QUEUE);
+            pthread_cond_broadcast(&mem->queue.task_ready);
+            pthread_mutex_unlock(&mem->queue.lock);
         }
-        pthread_mutex_unlock(&mem->queue.lock);
     }
 
-    shared_mem_release(mem);
-    exit(0);
+    stats->end_ns = now_ns();
+    if (stats->ns[PHASE_MULTIPLY] > 0 && (record = log_begin(LOG_GOPS))) {
+        record->worker = cons_id;
+        record->x = stats->ops / stats->ns[PHASE_MULTIPLY];
+        record->y = stats->ns[PHASE_MULTIPLY] / 1e9;
+        log_commit(record);
+    }
+
+    if (dtlb_fd != -1 &&
+        read(dtlb_fd, &dtlb_misses, sizeof(dtlb_misses)) ==
+            sizeof(dtlb_misses)) {
+        atomic_fetch_add(&mem->dtlb_misses, dtlb_misses);
+    } else {
+        atomic_fetch_add(&mem->dtlb_uncounted, 1);
+    }
+    if (dtlb_fd != -1) close(dtlb_fd);
+
+    // Every process maps the segment itself, and the one which faulted
+    // most of it in sees the most of it huge
+    if (page_backing == PAGES_TRANSPARENT) {
+        long long kb = mapping_huge_kb(mem),
+                  seen = atomic_load(&mem->thp_kb);
+        while (seen >= 0 && (kb < 0 || kb > seen) &&
+               !atomic_compare_exchange_weak(&mem->thp_kb, &seen, kb))
+            ;
+    }
+
+    free(result_block);
+    block_multiply_release();
+    atomic_fetch_sub(&worker_log->writers, 1);
 }
 
-void job_init(struct job *job, int prod_num, int mat_id) {
+void job_init(struct job *job, int prod_num, int mat_id, struct prng *prng) {
     job->prod_num = prod_num;
     job->mat_id = mat_id;
-    job->status = ST_D000;
+    job->status = 0;
+    atomic_init(&job->tasks_done, 0);
     memset(job->blocks, 0, sizeof(job->blocks));
 
-    for (int i = 0; i < MAT_SIZE; i++) {
-        for (int j = 0; j < MAT_SIZE; j++) {
-            job->matrix[i][j] = rand_range(MAT_EL_MIN, MAT_EL_MAX);
-        }
-    }
+    job->bound = leaf_bound();
+    job->width = width_for(job->bound);
+    prng_fill(prng, job_matrix(job), job->width, (size_t)mat_size * mat_size);
 }
 
-void queue_init(struct queue *queue) {
+// matrices is where the matrix buffers go, those of each width one after
+// the other, and temps the same for the temporary areas of
+// Strassen-Winograd products
+void queue_init(struct queue *queue, char *matrices, char *temps) {
     pthread_mutexattr_t attr;
+    pthread_condattr_t cond_attr;
 
     memset(queue, 0, sizeof(*queue));
+    for (int i = 0; i < NUM_WIDTHS; i++) {
+        for (int j = 0; j < buffer_count(i); j++) {
+            queue->free_buffers[i][queue->nfree_buffers[i]++] =
+                matrices - (char *)queue;
+            matrices += buffer_bytes(i);
+        }
+    }
+    queue->first = queue->last = -1;
+    for (int i = 0; i < QUEUE_SIZE; i++) {
+        queue->free_slots[queue->nfree++] = QUEUE_SIZE - 1 - i;
+    }
+    queue->temps_off = temps - (char *)queue;
+    for (int i = 0; i < MAX_PRODUCTS; i++) {
+        queue->free_temps[queue->nfree_temps++] = MAX_PRODUCTS - 1 - i;
+    }
 
     pthread_mutexattr_init(&attr);
     pthread_mutexattr_setpshared(&attr, 1);
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&queue->lock, &attr);
     pthread_mutexattr_destroy(&attr);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, 1);
+    for (int i = 0; i < QUEUE_SIZE; i++) {
+        for (int j = 0; j < MAX_GRID * MAX_GRID; j++) {
+            pthread_mutex_init(&queue->block_locks[i][j], &attr);
+        }
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, 1);
+    pthread_cond_init(&queue->task_ready, &cond_attr);
+    pthread_cond_init(&queue->slot_free, &cond_attr);
+    pthread_cond_init(&queue->all_done, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    for (int i = 0; i < MAX_CONSUMERS; i++) {
+        atomic_init(&queue->deques[i].top, 0);
+        atomic_init(&queue->deques[i].bottom, 0);
+    }
 }
 
-bool queue_push(struct queue *queue, struct job *job, struct shared_mem *mem) {
-    bool retval;
+// Give the job in a slot a free buffer of the given width
+static void queue_take_buffer(struct queue *queue, int slot, int width) {
+    int i = buffer_index(width);
 
-    pthread_mutex_lock(&queue->lock);
-    if (queue->cnt == MAX_INSERT_JOBS) {
-        retval = false;
-        goto queue_push_ret;
+    // Never more jobs of a width at once than buffer_layout counts
+    assert(queue->nfree_buffers[i] > 0);
+    queue->jobs[slot].matrix_off =
+        queue->free_buffers[i][--queue->nfree_buffers[i]] -
+        ((char *)&queue->jobs[slot] - (char *)queue);
+}
+
+static void queue_put_buffer(struct queue *queue, int slot) {
+    int i = buffer_index(queue->jobs[slot].width);
+
+    queue->free_buffers[i][queue->nfree_buffers[i]++] =
+        queue->jobs[slot].matrix_off +
+        ((char *)&queue->jobs[slot] - (char *)queue);
+}
+
+// Start a product for every pair of adjacent jobs which are both free,
+// going from the front of the chain. Returns whether any was started.
+static bool queue_schedule(struct queue *queue) {
+    int left, right, result;
+    struct job *job;
+    bool started = false;
+
+    left = queue->first;
+    while (left != -1 && (right = queue->slots[left].next) != -1) {
+        if (queue->slots[left].product != -1) {
+            left = right;
+            continue;
+        }
+        if (queue->slots[right].product != -1) {
+            left = queue->slots[right].next;
+            continue;
+        }
+
+        // There are never more products than half the jobs in the chain
+        assert(queue->nfree > 0);
+        result = queue->free_slots[--queue->nfree];
+        queue->slots[left].product = queue->slots[right].product = result;
+        queue->slots[result].left = left;
+        queue->slots[result].right = right;
+        queue->slots[result].product = -1;
+        queue->slots[result].temp = -1;
+        if (strassen_levels > 0) {
+            assert(queue->nfree_temps > 0);
+            queue->slots[result].temp =
+                queue->free_temps[--queue->nfree_temps];
+        }
+        queue->products++;
+        started = true;
+
+        // The result is assigned block by block before being added to, so
+        // only the bookkeeping needs clearing
+        job = queue->jobs + result;
+        job->prod_num = 0;
+        job->mat_id = 0;
+        job->status = 0;
+        atomic_init(&job->tasks_done, 0);
+        memset(job->blocks, 0, sizeof(job->blocks));
+        job->bound =
+            product_bound(queue->jobs[left].bound, queue->jobs[right].bound);
+        job->width = width_for(job->bound);
+        queue_take_buffer(queue, result, job->width);
+
+        left = queue->slots[right].next;
     }
+    return started;
+}
+
+// Take a free slot for a new job, waiting while the queue is full.
+// Returns -1 once every job has been created.
+int queue_reserve(struct queue *queue, struct shared_mem *mem) {
+    int slot;
 
+    stats_lock(&queue->lock, LOCK_QUEUE);
     pthread_mutex_lock(&mem->cntr_lock);
+    while (queue->cnt + queue->reserved == MAX_INSERT_JOBS &&
+           mem->job_created < max_job_created) {
+        pthread_mutex_unlock(&mem->cntr_lock);
+        stats_cond_wait(&queue->slot_free, &queue->lock);
+        pthread_mutex_lock(&mem->cntr_lock);
+    }
+
     if (mem->job_created == max_job_created) {
-        retval = false;
-        goto queue_push_ret;
+        slot = -1;
     } else {
         mem->job_created++;
-        retval = true;
-        memcpy(queue->jobs + queue->cnt, job, sizeof(*job));
-        queue->cnt++;
+        slot = queue->free_slots[--queue->nfree];
+        queue_take_buffer(queue, slot, width_for(leaf_bound()));
+        queue->reserved++;
+        // Let the producers waiting for a slot find out they are done
+        if (mem->job_created == max_job_created)
+            pthread_cond_broadcast(&queue->slot_free);
     }
 
-queue_push_ret:
     pthread_mutex_unlock(&mem->cntr_lock);
     pthread_mutex_unlock(&queue->lock);
-    return retval;
+    return slot;
 }
 
-bool queue_pop(struct queue *queue) {
-    bool retval;
+// Append the job filled in a reserved slot to the chain
+void queue_publish(struct queue *queue, int slot) {
+    stats_lock(&queue->lock, LOCK_QUEUE);
+
+    queue->reserved--;
+    queue->slots[slot] = (struct slot){queue->last, -1, -1, -1, -1, -1};
+    if (queue->last != -1)
+        queue->slots[queue->last].next = slot;
+    else
+        queue->first = slot;
+    queue->last = slot;
+    queue->cnt++;
+    queue->last_publish_ns = now_ns();
+    if (queue->first_publish_ns == 0)
+        queue->first_publish_ns = queue->last_publish_ns;
+
+    if (queue_schedule(queue)) pthread_cond_broadcast(&queue->task_ready);
 
-    pthread_mutex_lock(&queue->lock);
-    if (queue->cnt == 0) {
-        retval = false;
-        goto queue_pop_ret;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Tasks of the product built in job which can be handed out so far. The
+// phases of a Strassen-Winograd product each need the previous one done.
+static int ready_tasks(struct job *job) {
+    int done;
+
+    if (strassen_levels == 0) return product_tasks();
+    done = atomic_load(&job->tasks_done);
+    if (done < STRASSEN_MULTIPLY_TASK) return STRASSEN_MULTIPLY_TASK;
+    if (done < STRASSEN_COMBINE_TASK) return STRASSEN_COMBINE_TASK;
+    return STRASSEN_TASKS;
+}
+
+// Push tasks first to first + n - 1 of the product in slot, the last one
+// first so that the owner pops them in order. Only the owner pushes, and
+// only into its empty deque.
+static void deque_push(struct task_deque *deque, int slot, int first, int n) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+
+    for (int i = n - 1; i >= 0; i--, bottom++) {
+        atomic_store_explicit(&deque->tasks[bottom % DEQUE_SIZE],
+                              TASK_PACK(slot, first + i),
+                              memory_order_relaxed);
     }
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_release);
+}
+
+// Owner side. Returns false once the deque is empty.
+static bool deque_pop(struct task_deque *deque, int *packed) {
+    long bottom, top;
+    bool found = true;
+
+    bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&deque->top, memory_order_relaxed);
 
-    retval = true;
-    for (int i = 0; i < MAX_INSERT_JOBS; i++) {
-        queue->jobs[i] = queue->jobs[i + 1];
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return false;
     }
-    queue->cnt--;
+    *packed = atomic_load_explicit(&deque->tasks[bottom % DEQUE_SIZE],
+                                   memory_order_relaxed);
+    if (top == bottom) {
+        // The last task, which a thief may be taking at the same time
+        found = atomic_compare_exchange_strong_explicit(
+            &deque->top, &top, top + 1, memory_order_seq_cst,
+            memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return found;
+}
 
-queue_pop_ret:
-    pthread_mutex_unlock(&queue->lock);
-    return retval;
+// Thief side. Returns false if the deque is empty, retrying when another
+// consumer takes the same task first.
+static bool deque_steal(struct task_deque *deque, int *packed) {
+    long top, bottom;
+
+    for (;;) {
+        top = atomic_load_explicit(&deque->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+        if (top >= bottom) return false;
+
+        *packed = atomic_load_explicit(&deque->tasks[top % DEQUE_SIZE],
+                                       memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(
+                &deque->top, &top, top + 1, memory_order_seq_cst,
+                memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+// Steal a task from the other consumers, starting with the next one
+static bool queue_steal(struct queue *queue, int cons_id, int *packed) {
+    for (int i = 1; i < num_consumers; i++) {
+        if (deque_steal(&queue->deques[(cons_id - 1 + i) % num_consumers],
+                        packed)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-void queue_reverse(struct queue *queue, int start, int stop) {
-    struct job tmp;
-    int size = stop - start;
-    for (int i = start; i < start + size / 2; i++) {
-        tmp = queue->jobs[i];
-        queue->jobs[i] = queue->jobs[stop - i - 1];
-        queue->jobs[stop - i - 1] = tmp;
+// Move the ready tasks of the leftmost product which has any into the
+// deque of cons_id, which is empty. The first consumer to do so for a
+// product is credited with it. Returns whether there were any.
+// The caller holds the lock.
+static bool queue_claim(struct queue *queue, int cons_id) {
+    struct job *job;
+    int result, n;
+
+    for (int slot = queue->first; slot != -1; slot = queue->slots[slot].next) {
+        result = queue->slots[slot].product;
+        if (result == -1 || queue->slots[result].left != slot) continue;
+
+        job = queue->jobs + result;
+        n = min_int(ready_tasks(job) - job->status, DEQUE_SIZE);
+        if (n <= 0) continue;
+
+        if (job->status == 0) {
+            job->prod_num = -cons_id;
+            job->mat_id = rand_range(MAT_ID_MIN, MAT_ID_MAX);
+        }
+        deque_push(&queue->deques[cons_id - 1], result, job->status, n);
+        job->status += n;
+        // Let the idle consumers steal some
+        if (n > 1) pthread_cond_broadcast(&queue->task_ready);
+        return true;
     }
+    return false;
 }
 
-void queue_rotate_right(struct queue *queue, int k) {
-    pthread_mutex_lock(&queue->lock);
+// Next task for consumer cons_id: from its own deque, stolen from another
+// one or else claimed under the lock, waiting until there is one. Returns
+// the slot the product is built in, or -1 once done is set.
+int queue_next_task(struct queue *queue, int cons_id, int *task) {
+    struct task_deque *own = &queue->deques[cons_id - 1];
+    bool stolen = false;
+    int packed;
 
-    k = k % QUEUE_SIZE;
-    queue_reverse(queue, 0, QUEUE_SIZE - k);
-    queue_reverse(queue, QUEUE_SIZE - k, QUEUE_SIZE);
-    queue_reverse(queue, 0, QUEUE_SIZE);
+    for (;;) {
+        if (deque_pop(own, &packed) || queue_steal(queue, cons_id, &packed))
+            break;
 
-    pthread_mutex_unlock(&queue->lock);
+        // Tasks are only pushed under the lock, so any pushed after the
+        // steal here fails is announced by task_ready
+        stats_lock(&queue->lock, LOCK_QUEUE);
+        while (!queue->done && !queue_claim(queue, cons_id) &&
+               !(stolen = queue_steal(queue, cons_id, &packed))) {
+            stats_cond_wait(&queue->task_ready, &queue->lock);
+        }
+        if (queue->done) {
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        // Otherwise the claimed tasks are popped, unless all stolen already
+        if (stolen) break;
+    }
+    *task = packed & 0xffff;
+    return packed >> 16;
 }
 
-int queue_cnt(struct queue *queue) {
-    pthread_mutex_lock(&queue->lock);
-    int cnt = queue->cnt;
-    pthread_mutex_unlock(&queue->lock);
-    return cnt;
+// Temporary area number temp, of temp_bytes() bytes, or NULL for -1
+long *queue_temp(struct queue *queue, int temp) {
+    if (temp == -1) return NULL;
+    return (long *)((char *)queue + queue->temps_off + temp * temp_bytes());
 }
 
-void queue_incr_cnt(struct queue *queue) {
-    pthread_mutex_lock(&queue->lock);
-    queue->cnt++;
+// The first job of the chain, which is the whole product once done is set.
+// The caller holds the lock.
+struct job *queue_first(struct queue *queue) {
+    return queue->jobs + queue->first;
+}
+
+// Replace the 2 operands of a finished product with the product itself in
+// the chain and free their slots, then start whatever products that makes
+// possible. Sets done when it was the last product.
+void queue_product_done(struct queue *queue, int result,
+                        struct shared_mem *mem) {
+    int left, right, prev, next;
+
+    stats_lock(&queue->lock, LOCK_QUEUE);
+
+    left = queue->slots[result].left;
+    right = queue->slots[result].right;
+    prev = queue->slots[left].prev;
+    next = queue->slots[right].next;
+
+    if (queue->slots[result].temp != -1) {
+        queue->free_temps[queue->nfree_temps++] = queue->slots[result].temp;
+    }
+    queue->slots[result] = (struct slot){prev, next, -1, -1, -1, -1};
+    if (prev != -1)
+        queue->slots[prev].next = result;
+    else
+        queue->first = result;
+    if (next != -1)
+        queue->slots[next].prev = result;
+    else
+        queue->last = result;
+
+    queue_put_buffer(queue, left);
+    queue_put_buffer(queue, right);
+    queue->free_slots[queue->nfree++] = left;
+    queue->free_slots[queue->nfree++] = right;
+    queue->cnt--;
+    queue->products--;
+
+    pthread_mutex_lock(&mem->cntr_lock);
+    if (queue->cnt == 1 && queue->reserved == 0 && queue->products == 0 &&
+        mem->job_created == max_job_created) {
+        queue->done = true;
+        queue->done_ns = now_ns();
+        pthread_cond_broadcast(&queue->all_done);
+        pthread_cond_broadcast(&queue->task_ready);
+    }
+    pthread_mutex_unlock(&mem->cntr_lock);
+
+    if (queue_schedule(queue)) pthread_cond_broadcast(&queue->task_ready);
+    pthread_cond_signal(&queue->slot_free);
+
     pthread_mutex_unlock(&queue->lock);
 }
 
+// Creates the System V segment, and picks page_backing for it
+int shared_mem_create() {
+    int shmid;
+
+    if (huge_pages) {
+        if ((shmid = shmget(IPC_PRIVATE, shared_mem_size(),
+                            IPC_CREAT | IPC_EXCL | SHM_HUGETLB | 0644)) >= 0) {
+            page_backing = PAGES_HUGETLB;
+            return shmid;
+        }
+        fprintf(stderr,
+                "No huge pages for the segment (%s), asking for transparent "
+                "ones\n",
+                strerror(errno));
+        page_backing = PAGES_TRANSPARENT;
+    }
+
+    if ((shmid = shmget(IPC_PRIVATE, shared_mem_size(),
+                        IPC_CREAT | IPC_EXCL | 0644)) < 0) {
+        perror("Failed to shmget");
+        exit(1);
+    }
+    return shmid;
+}
+
+// The anonymous mapping used instead of the segment by threads, with
+// page_backing picked the same way
+struct shared_mem *shared_mem_map() {
+    void *ptr;
+
+    if (huge_pages) {
+        if ((ptr = mmap(NULL, shared_mem_size(), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) !=
+            MAP_FAILED) {
+            page_backing = PAGES_HUGETLB;
+            return ptr;
+        }
+        fprintf(stderr,
+                "No huge pages for the mapping (%s), asking for transparent "
+                "ones\n",
+                strerror(errno));
+    }
+
+    if ((ptr = mmap(NULL, shared_mem_size(), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("Failed to mmap");
+        exit(1);
+    }
+    if (huge_pages) {
+        if (madvise(ptr, shared_mem_size(), MADV_HUGEPAGE) == 0)
+            page_backing = PAGES_TRANSPARENT;
+        else
+            perror("Failed to madvise, using normal pages");
+    }
+    return ptr;
+}
+
+// The segment is marked for removal as soon as it is attached. It lives on
+// while any process has it attached, the workers through fork, and goes
+// away with the last of them however they exit. Huge pages would otherwise
+// stay reserved until reboot. Transparent huge pages are asked for on the
+// mapping, which the workers inherit with it.
 struct shared_mem *shared_mem_attach(int shmid) {
     void *ptr;
 
     if ((ptr = shmat(shmid, NULL, 0)) == (void *)(-1)) {
         perror("Failed to shmat");
+        shmctl(shmid, IPC_RMID, NULL);
         exit(1);
     }
+    if (shmctl(shmid, IPC_RMID, NULL) != 0)
+        perror("Failed to mark the segment for removal");
 
+    if (page_backing == PAGES_TRANSPARENT &&
+        madvise(ptr, shared_mem_size(), MADV_HUGEPAGE) != 0) {
+        perror("Failed to madvise, using normal pages");
+        page_backing = PAGES_NORMAL;
+    }
     return ptr;
 }
 
-void shared_mem_init(struct shared_mem *mem) {
+// kB of the mapping at addr which are backed by transparent huge pages,
+// or -1 if smaps cannot tell
+long long mapping_huge_kb(const void *addr) {
+    FILE *smaps;
+    char line[256];
+    unsigned long start, end;
+    long long kb, total = -1;
+
+    if (!(smaps = fopen("/proc/self/smaps", "r"))) return -1;
+    while (fgets(line, sizeof(line), smaps)) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            // The fields of our mapping end at the next one
+            if (total >= 0) break;
+            if ((uintptr_t)addr >= start && (uintptr_t)addr < end) total = 0;
+        } else if (total >= 0 &&
+                   (sscanf(line, "AnonHugePages: %lld", &kb) == 1 ||
+                    sscanf(line, "ShmemPmdMapped: %lld", &kb) == 1)) {
+            total += kb;
+        }
+    }
+    fclose(smaps);
+    return total;
+}
+
+// Matrices are page aligned and follow struct shared_mem in the segment
+static size_t shared_mem_header_size() {
+    return (sizeof(struct shared_mem) + 4095) & ~(size_t)4095;
+}
+
+// A matrix buffer of width index index
+size_t buffer_bytes(int index) {
+    return ((size_t)mat_size * mat_size * (2 << index) + 4095) &
+           ~(size_t)4095;
+}
+
+size_t matrices_bytes() {
+    size_t bytes = 0;
+
+    for (int i = 0; i < NUM_WIDTHS; i++) {
+        bytes += buffer_count(i) * buffer_bytes(i);
+    }
+    return bytes;
+}
+
+// The 7 left factors, 7 right factors and 7 products of a
+// Strassen-Winograd product, each (mat_size + 1) / 2 wide and in int64
+size_t temp_bytes() {
+    size_t h = (mat_size + 1) / 2;
+    return (3 * 7 * h * h * sizeof(long) + 4095) & ~(size_t)4095;
+}
+
+// Temporary areas of Strassen-Winograd products follow the matrices
+size_t shared_mem_size() {
+    size_t size = shared_mem_header_size() + matrices_bytes();
+
+    if (strassen_levels > 0) size += MAX_PRODUCTS * temp_bytes();
+    if (huge_pages) size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    return size;
+}
+
+void shared_mem_init(struct shared_mem *mem, int workers) {
     pthread_mutexattr_t attr;
 
     mem->job_created = 0;
+    atomic_init(&mem->dtlb_misses, 0);
+    atomic_init(&mem->dtlb_uncounted, 0);
+    atomic_init(&mem->thp_kb, 0);
+    memset(mem->producers, 0, sizeof(mem->producers));
+    memset(mem->consumers, 0, sizeof(mem->consumers));
+    log_init(&mem->log, workers);
 
     pthread_mutexattr_init(&attr);
     pthread_mutexattr_setpshared(&attr, 1);
     pthread_mutex_init(&mem->cntr_lock, &attr);
     pthread_mutexattr_destroy(&attr);
 
-    queue_init(&mem->queue);
+    queue_init(&mem->queue, (char *)mem + shared_mem_header_size(),
+               (char *)mem + shared_mem_header_size() + matrices_bytes());
+}
+
+// Faults in the rows of each matrix and temporary area which fall to
+// consumer cons_id when they are split evenly between the consumers
+static void touch_share(char *area, size_t bytes, int cons_id) {
+    size_t pages = bytes / 4096;
+    size_t start = pages * (cons_id - 1) / num_consumers;
+    size_t end = pages * cons_id / num_consumers;
+
+    memset(area + start * 4096, 0, (end - start) * 4096);
+}
+
+void first_touch(struct shared_mem *mem, int cons_id) {
+    char *matrices = (char *)mem + shared_mem_header_size();
+    char *temps = matrices + matrices_bytes();
+
+    for (int i = 0; i < NUM_WIDTHS; i++) {
+        for (int j = 0; j < buffer_count(i); j++) {
+            touch_share(matrices, buffer_bytes(i), cons_id);
+            matrices += buffer_bytes(i);
+        }
+    }
+    if (strassen_levels > 0) {
+        for (int i = 0; i < MAX_PRODUCTS; i++) {
+            touch_share(temps + i * temp_bytes(), temp_bytes(), cons_id);
+        }
+    }
 }
 
 void shared_mem_release(struct shared_mem *mem) {
@@ -603,63 +2344,109 @@ void shared_mem_release(struct shared_mem *mem) {
     }
 }
 
-void job_print(struct job *job) {
-    printf("Job { ");
-    printf("Producer id = %d, ", job->prod_num);
-    printf("Matrix id = %d, ", job->mat_id);
-    printf("Status = %s", job_status_to_str(job->status));
-    printf(" }\n");
-    fflush(stdout);
+void log_init(struct log_ring *log, int writers) {
+    atomic_init(&log->tail, 0);
+    atomic_init(&log->writers, writers);
+    log->head = 0;
+    for (long i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&log->records[i].seq, i);
+    }
 }
 
-char *job_status_to_str(enum job_status status) {
-    static char str[20];
-    switch (status) {
-        case ST_D000:
-            sprintf(str, "D000");
-            break;
-        case ST_D001:
-            sprintf(str, "D001");
-            break;
-        case ST_D010:
-            sprintf(str, "D010");
-            break;
-        case ST_D011:
-            sprintf(str, "D011");
-            break;
-        case ST_D100:
-            sprintf(str, "D100");
+// Takes the next record of the ring, or returns NULL when log_level leaves
+// out records of this kind. The record must then be filled and committed.
+struct log_record *log_begin(enum log_kind kind) {
+    struct log_record *record;
+    long pos;
+
+    if (log_level < (kind < LOG_BLOCK ? LOG_SUMMARY : LOG_VERBOSE))
+        return NULL;
+
+    pos = atomic_fetch_add_explicit(&worker_log->tail, 1, memory_order_relaxed);
+    record = &worker_log->records[pos % LOG_RING_SIZE];
+    // Until the drain is done with the record a lap before
+    while (atomic_load_explicit(&record->seq, memory_order_acquire) != pos) {
+        sched_yield();
+    }
+    record->kind = kind;
+    return record;
+}
+
+void log_commit(struct log_record *record) {
+    atomic_store_explicit(
+        &record->seq,
+        atomic_load_explicit(&record->seq, memory_order_relaxed) + 1,
+        memory_order_release);
+}
+
+static const char *log_messages[] = {
+    "Reading",
+    "Copying",
+    "Adding",
+    "Summed quadrants into left factor",
+    "Summed quadrants into right factor",
+    "Multiplying factors",
+    "Summing products into quadrant",
+};
+
+static void log_print_producer(int prod_id) {
+    if (prod_id > 0)
+        printf("Producer id = %d, ", prod_id);
+    else
+        printf("Producer id = %d (consumer), ", -prod_id);
+}
+
+static void log_print(const struct log_record *record) {
+    switch (record->kind) {
+        case LOG_PRODUCED:
+            printf("Produced: Job { Producer id = %d, Matrix id = %d, ",
+                   record->prod_id, record->mat_id);
+            printf("Queue slot = %d }\n", record->a);
             break;
-        case ST_D101:
-            sprintf(str, "D101");
+        case LOG_PRODUCT:
+            printf("In Consumer %d: ", record->worker);
+            log_print_producer(record->prod_id);
+            printf("Matrix id = %d, Product of Matrix id = %d and %d done\n",
+                   record->mat_id, record->a, record->b);
             break;
-        case ST_D110:
-            sprintf(str, "D110");
+        case LOG_GOPS:
+            printf("Consumer %d: %.2f GOPS over %.2f sec of block "
+                   "multiplication\n",
+                   record->worker, record->x, record->y);
             break;
-        case ST_D111:
-            sprintf(str, "D111");
+        case LOG_BLOCK:
+            printf("In Consumer %d: ", record->worker);
+            log_print_producer(record->prod_id);
+            printf("Matrix id = %d, %s block (%d, %d)\n", record->mat_id,
+                   log_messages[record->message], record->a, record->b);
             break;
-        case ST_Complete:
-            sprintf(str, "Complete");
+        case LOG_STRASSEN:
+            printf("In Consumer %d: ", record->worker);
+            log_print_producer(record->prod_id);
+            printf("Matrix id = %d, %s %d\n", record->mat_id,
+                   log_messages[record->message], record->a);
             break;
     }
-    return str;
 }
 
-void adjust_stack_size() {
-    const rlim_t required_size = 2 * sizeof(struct job);
-    struct rlimit rl;
+// Formats the records committed so far, in the order they were taken, and
+// writes them out at once. Returns how many there were.
+int log_drain(struct log_ring *log) {
+    struct log_record *record;
+    int n = 0;
 
-    if (getrlimit(RLIMIT_STACK, &rl) != 0) {
-        perror("Failed to getrlimit");
-        exit(1);
-    }
-
-    if (rl.rlim_cur < required_size) {
-        rl.rlim_cur = required_size;
-        if (setrlimit(RLIMIT_STACK, &rl) != 0) {
-            perror("Failed to setrlimit");
-            exit(1);
+    for (;;) {
+        record = &log->records[log->head % LOG_RING_SIZE];
+        if (atomic_load_explicit(&record->seq, memory_order_acquire) !=
+            log->head + 1) {
+            break;
         }
+        log_print(record);
+        atomic_store_explicit(&record->seq, log->head + LOG_RING_SIZE,
+                              memory_order_release);
+        log->head++;
+        n++;
     }
+    if (n > 0) fflush(stdout);
+    return n;
 }
@@ -0,0 +1,93 @@
+-- Wireshark dissector for captures written by r_capture_start.
+--
+-- Records use LINKTYPE_USER0 and start with an 8 byte header (direction,
+-- reserved, peer port, peer IPv4 address) followed by the MRP frame as it
+-- was on the wire, possibly cut short. See the frame layout in rsocket.c.
+--
+-- Install into ~/.local/lib/wireshark/plugins/ or load with
+--   wireshark -X lua_script:mrp_dissector.lua capture.pcap
+
+local mrp = Proto("mrp", "MRP reliable protocol")
+
+local directions = { [0] = "Received", [1] = "Sent" }
+local types = { [0] = "Data", [1] = "Ack", [2] = "Reset" }
+
+local f = mrp.fields
+f.dir = ProtoField.uint8("mrp.dir", "Direction", base.DEC, directions)
+f.peer_port = ProtoField.uint16("mrp.peer.port", "Peer port")
+f.peer_addr = ProtoField.ipv4("mrp.peer.addr", "Peer address")
+f.type = ProtoField.uint8("mrp.type", "Type", base.DEC, types, 0x03)
+f.epoch_flag = ProtoField.bool("mrp.flags.epoch", "Epoch", 8, nil, 0x04)
+f.seq_len = ProtoField.uint8("mrp.seq_len", "Sequence number bytes - 1",
+			     base.DEC, nil, 0x30)
+f.crc_flag = ProtoField.bool("mrp.flags.crc", "CRC32C trailer", 8, nil, 0x40)
+f.stream_flag = ProtoField.bool("mrp.flags.stream", "Stream byte", 8, nil,
+				0x80)
+f.stream = ProtoField.uint8("mrp.stream", "Stream")
+f.epoch = ProtoField.uint32("mrp.epoch", "Epoch", base.HEX)
+f.base = ProtoField.uint32("mrp.base", "Base sequence number")
+f.seq = ProtoField.uint32("mrp.seq", "Sequence number (truncated)")
+f.payload = ProtoField.bytes("mrp.payload", "Payload")
+f.crc = ProtoField.uint32("mrp.crc", "CRC32C", base.HEX)
+
+function mrp.dissector(buf, pinfo, tree)
+	if buf:len() < 9 then
+		return 0
+	end
+	pinfo.cols.protocol = "MRP"
+	local t = tree:add(mrp, buf())
+	local dir = buf(0, 1):uint()
+	t:add(f.dir, buf(0, 1))
+	t:add(f.peer_port, buf(2, 2))
+	t:add(f.peer_addr, buf(4, 4))
+
+	local off = 8
+	local tb = buf(off, 1):uint()
+	t:add(f.type, buf(off, 1))
+	t:add(f.epoch_flag, buf(off, 1))
+	t:add(f.seq_len, buf(off, 1))
+	t:add(f.crc_flag, buf(off, 1))
+	t:add(f.stream_flag, buf(off, 1))
+	off = off + 1
+
+	local stream = 0
+	if bit.band(tb, 0x80) ~= 0 and off < buf:len() then
+		stream = buf(off, 1):uint()
+		t:add(f.stream, buf(off, 1))
+		off = off + 1
+	end
+	if bit.band(tb, 0x04) ~= 0 and off + 8 <= buf:len() then
+		t:add(f.epoch, buf(off, 4))
+		t:add(f.base, buf(off + 4, 4))
+		off = off + 8
+	end
+	local seq_bytes = bit.rshift(bit.band(tb, 0x30), 4) + 1
+	local seq = "?"
+	if off + seq_bytes <= buf:len() then
+		seq = buf(off, seq_bytes):uint()
+		t:add(f.seq, buf(off, seq_bytes))
+		off = off + seq_bytes
+	end
+	-- The trailer is only there if the frame was captured whole
+	local payload_end = buf:len()
+	if bit.band(tb, 0x40) ~= 0 and buf:len() == buf:reported_len() and
+	   payload_end - off >= 4 then
+		payload_end = payload_end - 4
+	end
+	if off < payload_end then
+		t:add(f.payload, buf(off, payload_end - off))
+	end
+	if payload_end < buf:len() then
+		t:add(f.crc, buf(payload_end, 4))
+	end
+
+	local peer = tostring(buf(4, 4):ipv4()) .. ":" .. buf(2, 2):uint()
+	pinfo.cols.src = dir == 1 and "local" or peer
+	pinfo.cols.dst = dir == 1 and peer or "local"
+	pinfo.cols.info = string.format("%s stream=%d seq=%s",
+					types[bit.band(tb, 0x03)] or "?",
+					stream, tostring(seq))
+	return buf:len()
+end
+
+DissectorTable.get("wtap_encap"):add(wtap_encaps.USER0, mrp)
@@ -0,0 +1,116 @@
+#ifndef __MRP_ENGINE_H__
+#define __MRP_ENGINE_H__
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// The MRP protocol engine, decoupled from real time and real sockets.
+//
+// rsocket.c drives one engine from its R and S threads using the
+// monotonic clock and a UDP socket. mrp_sim.c drives many engines from a
+// single-threaded discrete-event loop using a virtual clock and simulated
+// links, so the same code paths can be exercised in virtual time.
+
+struct mrp_clock {
+	// Current time in milliseconds. Only differences are meaningful.
+	uint64_t (*now_ms)(void *ctx);
+	void *ctx;
+};
+
+// Largest number of frames handed to mrp_io.send_batch at once
+#define MRP_BATCH 64
+
+// One outgoing datagram, header, payload and checksum trailer kept in
+// separate fragments
+struct mrp_frame {
+	struct iovec iov[3];
+	int iovcnt;
+	const struct sockaddr_in *to;
+	socklen_t to_len;
+};
+
+struct mrp_io {
+	// Transmit one datagram made of iovcnt fragments. Returns the number
+	// of bytes sent or -1 with errno set.
+	ssize_t (*send)(void *ctx, const struct iovec *iov, int iovcnt,
+			const struct sockaddr_in *to, socklen_t to_len);
+	// Optional. Transmit up to n frames, returning how many were sent or
+	// -1 if the first one failed. send is used one by one when NULL.
+	int (*send_batch)(void *ctx, const struct mrp_frame *frames,
+			  unsigned int n);
+	void *ctx;
+};
+
+struct mrp_engine;
+
+// Completion of a message, with status 0 once every peer acknowledged it
+// or -1 if it was given up on because the engine was freed first
+typedef void (*mrp_done_fn)(void *ctx, int status);
+
+struct mrp_engine *mrp_engine_new(const struct mrp_clock *clock,
+				  const struct mrp_io *io, float drop_prob);
+void mrp_engine_free(struct mrp_engine *eng);
+
+// Send a data message on a stream and track it until it is acknowledged.
+ssize_t mrp_engine_send(struct mrp_engine *eng, uint8_t stream,
+			const void *buf, size_t nbytes,
+			const struct sockaddr_in *to, socklen_t to_len);
+// mrp_engine_send, calling done(ctx, status) when the message completes.
+// With MRP_SEND_ZEROCOPY in flags buf is not copied and must stay
+// untouched until then. done is not called if the send fails.
+ssize_t mrp_engine_send_notify(struct mrp_engine *eng, uint8_t stream,
+			       const void *buf, size_t nbytes,
+			       const struct sockaddr_in *to, socklen_t to_len,
+			       int flags, mrp_done_fn done, void *ctx);
+// Send one message to npeers distinct peers, sharing a single copy of the
+// payload between them. Returns the number of peers it was sent to, or -1
+// with errno set to EINVAL if a peer is listed more than once.
+ssize_t mrp_engine_send_many(struct mrp_engine *eng, uint8_t stream,
+			     const void *buf, size_t nbytes,
+			     const struct sockaddr_in *to, size_t npeers);
+// Feed one received datagram into the engine.
+void mrp_engine_input(struct mrp_engine *eng, const uint8_t *buf, size_t len,
+		      const struct sockaddr_in *from, socklen_t from_len);
+// Retransmit every message which has been unacknowledged for TIMEOUT.
+void mrp_engine_tick(struct mrp_engine *eng);
+// Pop a delivered message of a stream without blocking, or of the highest
+// priority ready stream if stream is -1. MRP_FILE_STREAM is left out of
+// -1, its chunks are only for whoever receives the file. Returns -1 with
+// errno set to EAGAIN if nothing is queued.
+ssize_t mrp_engine_recv(struct mrp_engine *eng, int stream, void *buf,
+			size_t nbytes, struct sockaddr_in *from,
+			socklen_t *from_len);
+// Like mrp_engine_recv, but point *data at the message payload in place
+// instead of copying it. It must be handed back to mrp_engine_recv_release.
+ssize_t mrp_engine_recv_borrow(struct mrp_engine *eng, int stream,
+			       const void **data, struct sockaddr_in *from,
+			       socklen_t *from_len);
+void mrp_engine_recv_release(const void *data);
+// Block until mrp_engine_recv on the stream would not fail with EAGAIN
+void mrp_engine_wait_recv(struct mrp_engine *eng, int stream);
+// Have notify called whenever messages are queued for mrp_engine_recv, for
+// callers waiting on several engines at once. Set it before input starts.
+void mrp_engine_set_recv_notify(struct mrp_engine *eng,
+				void (*notify)(void *ctx), void *ctx);
+int mrp_engine_set_priority(struct mrp_engine *eng, uint8_t stream,
+			    int priority);
+// Takes the MRP_OPT_* options of rsocket.h and the engine only ones below
+int mrp_engine_setopt(struct mrp_engine *eng, int opt, uint32_t value);
+size_t mrp_engine_unacked(struct mrp_engine *eng);
+// Block until nothing is unacknowledged, for at most timeout_ms or forever
+// if it is negative. Returns -1 with errno ETIMEDOUT on timeout.
+int mrp_engine_flush(struct mrp_engine *eng, int timeout_ms);
+
+// CRC32C of len bytes continuing from crc, 0 to start
+uint32_t mrp_crc32c(uint32_t crc, const void *buf, size_t len);
+
+// First sequence number of every stream this engine sends to a peer. A
+// testing aid for wraparound only.
+#define MRP_ENGINE_OPT_INITIAL_SEQ 100
+// Epoch this engine announces to its peers, random by default. Setting it
+// makes a simulated run reproducible.
+#define MRP_ENGINE_OPT_EPOCH 101
+
+#endif // __MRP_ENGINE_H__
@@ -0,0 +1,485 @@
+// Deterministic discrete-event simulator for MRP.
+//
+// Every peer is an mrp_engine driven by a virtual clock. Datagrams travel
+// over simulated links with a configurable one-way delay, jitter and loss
+// rate, and the retransmission timer fires in virtual time, so a lossy run
+// that would take minutes on real sockets finishes in milliseconds. All
+// randomness comes from one seeded generator, so a run is reproducible.
+
+#include "mrp_engine.h"
+#include "rsocket.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_BASE_ADDR 0x0a000000u // 10.0.0.0
+#define SIM_PORT 50030
+#define SIM_MAX_TIME_MS (3600ULL * 1000ULL)
+
+enum event_type {
+	EV_Deliver,
+	EV_Tick,
+};
+
+struct event {
+	uint64_t time;
+	uint64_t order; // Tie breaker, keeps the heap ordering deterministic
+	enum event_type type;
+	int peer;
+	struct sockaddr_in from;
+	uint8_t *buf;
+	size_t len;
+};
+
+struct event_heap {
+	struct event *evs;
+	size_t cnt;
+	size_t cap;
+};
+
+struct sim_peer {
+	struct mrp_engine *eng;
+	struct sim *sim;
+	int idx;
+	size_t delivered;
+	size_t unacked;
+};
+
+struct sim {
+	uint64_t now;
+	uint64_t order;
+	uint64_t rng;
+	struct event_heap heap;
+	struct sim_peer *peers;
+	int npeers;
+	size_t unacked; // Sum over all peers
+
+	// Link model
+	uint64_t delay_ms;
+	uint64_t jitter_ms;
+	double loss;
+	double corrupt; // Chance of one flipped bit in a datagram
+
+	// Engine options
+	bool compact;
+	bool checksum;
+	uint32_t initial_seq;
+
+	// Stats
+	size_t datagrams;
+	size_t bytes;
+	size_t dropped;
+	size_t corrupted;
+	size_t bad; // Deliveries with a wrong payload
+	size_t events;
+};
+
+// splitmix64, enough for link decisions and cheap to seed
+static uint64_t sim_rand(struct sim *sim)
+{
+	uint64_t z = (sim->rng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static double sim_rand_unit(struct sim *sim)
+{
+	return (sim_rand(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int event_before(const struct event *a, const struct event *b)
+{
+	if (a->time != b->time)
+		return a->time < b->time;
+	return a->order < b->order;
+}
+
+static void heap_push(struct event_heap *heap, const struct event *ev)
+{
+	if (heap->cnt == heap->cap) {
+		heap->cap = heap->cap ? 2 * heap->cap : 1024;
+		heap->evs = realloc(heap->evs, heap->cap * sizeof(*heap->evs));
+		if (!heap->evs) {
+			perror("Failed to grow event heap");
+			exit(1);
+		}
+	}
+	size_t idx = heap->cnt++;
+	while (idx > 0) {
+		size_t parent = (idx - 1) / 2;
+		if (!event_before(ev, &heap->evs[parent]))
+			break;
+		heap->evs[idx] = heap->evs[parent];
+		idx = parent;
+	}
+	heap->evs[idx] = *ev;
+}
+
+static struct event heap_pop(struct event_heap *heap)
+{
+	struct event top = heap->evs[0];
+	struct event last = heap->evs[--heap->cnt];
+	size_t idx = 0;
+	for (;;) {
+		size_t child = 2 * idx + 1;
+		if (child >= heap->cnt)
+			break;
+		if (child + 1 < heap->cnt &&
+		    event_before(&heap->evs[child + 1], &heap->evs[child]))
+			child++;
+		if (!event_before(&heap->evs[child], &last))
+			break;
+		heap->evs[idx] = heap->evs[child];
+		idx = child;
+	}
+	if (heap->cnt)
+		heap->evs[idx] = last;
+	return top;
+}
+
+static void sim_schedule(struct sim *sim, struct event *ev)
+{
+	ev->order = sim->order++;
+	heap_push(&sim->heap, ev);
+}
+
+static struct sockaddr_in peer_addr(int idx)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(SIM_BASE_ADDR + idx);
+	addr.sin_port = htons(SIM_PORT);
+	return addr;
+}
+
+static int addr_peer(const struct sockaddr_in *addr)
+{
+	return ntohl(addr->sin_addr.s_addr) - SIM_BASE_ADDR;
+}
+
+static uint64_t sim_now_ms(void *ctx)
+{
+	return ((struct sim *)ctx)->now;
+}
+
+static ssize_t sim_send(void *ctx, const struct iovec *iov, int iovcnt,
+			const struct sockaddr_in *to,
+			__attribute__((unused)) socklen_t to_len)
+{
+	struct sim_peer *peer = ctx;
+	struct sim *sim = peer->sim;
+	int dst = addr_peer(to);
+	size_t len = 0;
+
+	if (dst < 0 || dst >= sim->npeers) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	sim->datagrams++;
+	sim->bytes += len;
+	if (sim_rand_unit(sim) < sim->loss) {
+		sim->dropped++;
+		return len;
+	}
+	bool corrupt = sim_rand_unit(sim) < sim->corrupt;
+
+	struct event ev = {
+	    .type = EV_Deliver,
+	    .peer = dst,
+	    .from = peer_addr(peer->idx),
+	    .len = len,
+	};
+	ev.time = sim->now + sim->delay_ms;
+	if (sim->jitter_ms)
+		ev.time += sim_rand(sim) % (sim->jitter_ms + 1);
+	ev.buf = malloc(len);
+	len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(ev.buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	if (corrupt) {
+		// Flip one bit anywhere in the datagram
+		uint64_t bit = sim_rand(sim) % (len * 8);
+		ev.buf[bit / 8] ^= 1 << (bit % 8);
+		sim->corrupted++;
+	}
+	sim_schedule(sim, &ev);
+	return len;
+}
+
+static void sim_update_unacked(struct sim *sim, struct sim_peer *peer)
+{
+	size_t unacked = mrp_engine_unacked(peer->eng);
+	sim->unacked = sim->unacked - peer->unacked + unacked;
+	peer->unacked = unacked;
+}
+
+// Create the engine of a peer, as a host does when its process starts
+static void sim_peer_start(struct sim *sim, struct sim_peer *peer)
+{
+	const struct mrp_clock clock = {.now_ms = sim_now_ms, .ctx = sim};
+	const struct mrp_io io = {.send = sim_send, .ctx = peer};
+	// Loss is modelled by the links, not by the engine
+	peer->eng = mrp_engine_new(&clock, &io, 0);
+	if (!peer->eng) {
+		perror("Failed to create engine");
+		exit(1);
+	}
+	mrp_engine_setopt(peer->eng, MRP_OPT_COMPACT_HEADER, sim->compact);
+	mrp_engine_setopt(peer->eng, MRP_OPT_CHECKSUM, sim->checksum);
+	mrp_engine_setopt(peer->eng, MRP_ENGINE_OPT_INITIAL_SEQ,
+			  sim->initial_seq);
+	mrp_engine_setopt(peer->eng, MRP_ENGINE_OPT_EPOCH, sim_rand(sim));
+}
+
+// Peer idx sends msgs messages to the next fanout peers in the ring
+static void sim_peer_send(struct sim *sim, int idx, size_t msgs, int nstreams,
+			  int fanout)
+{
+	struct sim_peer *peer = &sim->peers[idx];
+	struct sockaddr_in *to = calloc(fanout, sizeof(*to));
+	for (int f = 0; f < fanout; f++)
+		to[f] = peer_addr((idx + 1 + f) % sim->npeers);
+	for (size_t m = 0; m < msgs; m++) {
+		// The complement lets the receiver spot corruption
+		uint32_t payload[2] = {m, ~m};
+		if (fanout == 1)
+			mrp_engine_send(peer->eng, m % nstreams, &payload,
+					sizeof(payload), to, sizeof(*to));
+		else
+			mrp_engine_send_many(peer->eng, m % nstreams, &payload,
+					     sizeof(payload), to, fanout);
+	}
+	sim_update_unacked(sim, peer);
+	free(to);
+}
+
+// Process events until everything sent has been acknowledged. An ACK is
+// only sent once the data arrived, so nothing unacked means every message
+// has been delivered at least once.
+static void sim_run(struct sim *sim)
+{
+	while (sim->heap.cnt && sim->unacked) {
+		struct event ev = heap_pop(&sim->heap);
+		struct sim_peer *peer = &sim->peers[ev.peer];
+		if (ev.time > SIM_MAX_TIME_MS) {
+			sim_schedule(sim, &ev);
+			break;
+		}
+		sim->now = ev.time;
+		sim->events++;
+
+		if (ev.type == EV_Deliver) {
+			uint32_t buf[16];
+			struct sockaddr_in from;
+			socklen_t from_len;
+			ssize_t len;
+
+			mrp_engine_input(peer->eng, ev.buf, ev.len, &ev.from,
+					 sizeof(ev.from));
+			free(ev.buf);
+			while ((len = mrp_engine_recv(peer->eng, -1, buf,
+						      sizeof(buf), &from,
+						      &from_len)) >= 0) {
+				peer->delivered++;
+				if (len != 2 * sizeof(buf[0]) ||
+				    buf[1] != ~buf[0])
+					sim->bad++;
+			}
+			sim_update_unacked(sim, peer);
+		} else {
+			mrp_engine_tick(peer->eng);
+			ev.time = sim->now + T * 1000;
+			sim_schedule(sim, &ev);
+		}
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-p peers] [-m messages] [-n streams] [-f fanout] "
+		"[-l loss] [-d delay_ms] [-j jitter_ms] [-s seed] [-c] "
+		"[-i initial_seq] [-x corrupt] [-k] [-r] [-R]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim sim;
+	int npeers = 1000, nstreams = 1, fanout = 1;
+	int opt;
+	bool restart = false, restart_receiver = false;
+	size_t msgs = 100;
+	uint64_t seed = 1;
+	struct timespec wall_start, wall_end;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.delay_ms = 10;
+	sim.jitter_ms = 5;
+	sim.loss = DROP_PROBABILITY;
+
+	while ((opt = getopt(argc, argv, "p:m:n:f:l:d:j:s:ci:x:krR")) != -1) {
+		switch (opt) {
+		case 'p':
+			npeers = atoi(optarg);
+			break;
+		case 'm':
+			msgs = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			nstreams = atoi(optarg);
+			break;
+		case 'f':
+			fanout = atoi(optarg);
+			break;
+		case 'l':
+			sim.loss = atof(optarg);
+			break;
+		case 'd':
+			sim.delay_ms = strtoull(optarg, NULL, 10);
+			break;
+		case 'j':
+			sim.jitter_ms = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			sim.compact = true;
+			break;
+		case 'i':
+			sim.initial_seq = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			sim.corrupt = atof(optarg);
+			break;
+		case 'k':
+			sim.checksum = true;
+			break;
+		case 'r':
+			restart = true;
+			break;
+		case 'R':
+			restart_receiver = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	// mrp_engine_recv(-1) leaves out MRP_FILE_STREAM
+	if (npeers < 2 || nstreams < 1 || nstreams > MRP_FILE_STREAM ||
+	    fanout < 1 || fanout >= npeers ||
+	    sim.loss < 0 || sim.loss >= 1 || sim.corrupt < 0 ||
+	    sim.corrupt >= 1)
+		usage(argv[0]);
+
+	sim.rng = seed;
+	sim.npeers = npeers;
+	sim.peers = calloc(npeers, sizeof(*sim.peers));
+	for (int i = 0; i < npeers; i++) {
+		struct sim_peer *peer = &sim.peers[i];
+		peer->sim = &sim;
+		peer->idx = i;
+		sim_peer_start(&sim, peer);
+
+		// Stagger the retransmission timers like independent hosts
+		struct event tick = {.type = EV_Tick, .peer = i};
+		tick.time = sim_rand(&sim) % (T * 1000);
+		sim_schedule(&sim, &tick);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+	// A peer listed twice would get one sequence number for both copies,
+	// so send_many must refuse the batch before sending anything
+	struct sockaddr_in twice[3] = {peer_addr(1), peer_addr(npeers - 1),
+				       peer_addr(1)};
+	uint32_t probe = 0;
+	if (mrp_engine_send_many(sim.peers[0].eng, 0, &probe, sizeof(probe),
+				 twice, 3) != -1 || errno != EINVAL) {
+		fprintf(stderr, "send_many accepted a duplicate peer\n");
+		return 1;
+	}
+
+	for (int i = 0; i < npeers; i++)
+		sim_peer_send(&sim, i, msgs, nstreams, fanout);
+	sim_run(&sim);
+
+	// Peer 0 restarts with a new engine on the same address and sends its
+	// messages again, numbered from the start. Its receivers still hold
+	// the stream state of the old association and must not mistake the
+	// new messages for duplicates of the old ones.
+	size_t expected = msgs * npeers * fanout;
+	if (restart) {
+		mrp_engine_free(sim.peers[0].eng);
+		sim.unacked -= sim.peers[0].unacked;
+		sim.peers[0].unacked = 0;
+		sim_peer_start(&sim, &sim.peers[0]);
+		sim_peer_send(&sim, 0, msgs, nstreams, fanout);
+		sim_run(&sim);
+		expected += msgs * fanout;
+	}
+	// Peer 1 restarts instead, losing what it knew of the streams peer 0
+	// sends it. Peer 0 goes on numbering where it left off and leaves its
+	// epoch out, as the old engine acknowledged it. The restarted peer
+	// sends as well, so its own receivers see its epoch change.
+	if (restart_receiver) {
+		mrp_engine_free(sim.peers[1].eng);
+		sim.unacked -= sim.peers[1].unacked;
+		sim.peers[1].unacked = 0;
+		sim_peer_start(&sim, &sim.peers[1]);
+		sim_peer_send(&sim, 0, msgs, nstreams, fanout);
+		sim_peer_send(&sim, 1, msgs, nstreams, fanout);
+		sim_run(&sim);
+		expected += 2 * msgs * fanout;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+	size_t delivered = 0;
+	for (int i = 0; i < npeers; i++)
+		delivered += sim.peers[i].delivered;
+	double wall_ms = (wall_end.tv_sec - wall_start.tv_sec) * 1e3 +
+			 (wall_end.tv_nsec - wall_start.tv_nsec) / 1e6;
+
+	printf("peers=%d messages/peer=%zu streams=%d fanout=%d loss=%.3f "
+	       "delay=%llums jitter=%llums seed=%llu%s%s\n",
+	       npeers, msgs, nstreams, fanout, sim.loss, (unsigned long long)sim.delay_ms,
+	       (unsigned long long)sim.jitter_ms, (unsigned long long)seed,
+	       restart ? " restart" : "",
+	       restart_receiver ? " restart-receiver" : "");
+	printf("virtual time: %.3f s, wall time: %.1f ms, events: %zu\n",
+	       sim.now / 1000.0, wall_ms, sim.events);
+	printf("datagrams: %zu (%zu bytes), dropped: %zu, corrupted: %zu\n",
+	       sim.datagrams, sim.bytes, sim.dropped, sim.corrupted);
+	printf("delivered: %zu (expected %zu, %zu bad), unacked: %zu\n",
+	       delivered, expected, sim.bad, sim.unacked);
+
+	while (sim.heap.cnt) {
+		struct event ev = heap_pop(&sim.heap);
+		if (ev.type == EV_Deliver)
+			free(ev.buf);
+	}
+	for (int i = 0; i < npeers; i++)
+		mrp_engine_free(sim.peers[i].eng);
+	free(sim.peers);
+	free(sim.heap.evs);
+
+	// Every message delivered exactly once and intact, and all of them
+	// acknowledged
+	if (delivered != expected || sim.bad != 0 || sim.unacked != 0)
+		return 1;
+	return 0;
+}
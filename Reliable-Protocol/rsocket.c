@@ -1,16 +1,45 @@
+#define _GNU_SOURCE
+
 #include "rsocket.h"
+#include "mrp_engine.h"
 #include <assert.h>
 #include <errno.h>
+#include <linux/filter.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #define NUM_BUCKETS 50
 #define RECV_BUF_SIZE 1600
+// Size and alignment of a receive buffer, a power of two
+#define RXBUF_SIZE 2048
+// Receive buffers kept around for reuse
+#define RXBUF_POOL_MAX 1024
+// How far ahead of the next in order message a stream accepts and holds
+// back messages, which bounds its reorder buffer
+#define RECV_WINDOW 1024
+// r_sendfile chunk size and how many chunks may be unacknowledged at once
+#define FILE_CHUNK 1400
+#define FILE_WINDOW 128
+// Default for MRP_OPT_LINGER, enough for a good number of retransmissions
+#define LINGER_MS (10 * TIMEOUT * 1000)
+// Frames a thread can have waiting for the capture writer
+#define CAP_RING_SIZE 8192
+// Most bytes of a frame captured, header included
+#define CAP_SNAP_MAX 240
+#define CAP_FLUSH_MS 10
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
 typedef void (*free_func)(void *);
 
 static __attribute__((noreturn)) void unreachable(const char *message)
@@ -68,7 +97,41 @@ static void list_del(struct list_head *el)
 	el->next->prev = el->prev;
 }
 
+// For lists kept as a pointer to their first element, NULL when empty
+static void list_push_back(struct list_head **first, struct list_head *el)
+{
+	if (*first) {
+		list_add_tail(*first, el);
+	} else {
+		list_init(el);
+		*first = el;
+	}
+}
+
+static void list_unlink(struct list_head **first, struct list_head *el)
+{
+	if (el->next == el) {
+		*first = NULL;
+	} else {
+		if (*first == el)
+			*first = el->next;
+		list_del(el);
+	}
+}
+
+// Serial number arithmetic (RFC 1982), so ordering survives wraparound
+static bool seq_lt(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+static bool seq_gt(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) > 0;
+}
+
 struct message {
+	uint32_t seq_no;
 	uint8_t *buf;
 	size_t buf_len;
 	struct list_head head;
@@ -77,20 +140,68 @@ struct message {
 	free_func ff;
 };
 
-static void free_message(void *ptr)
+// Datagrams are received straight into one of these and a data message
+// stays in it, with buf pointing at the payload, until the application
+// has consumed it. The payload is never copied out.
+struct rx_buf {
+	struct message msg;
+	uint8_t data[RECV_BUF_SIZE];
+};
+
+// Buffers are aligned to their size, so any pointer into one leads back
+// to its start
+_Static_assert(sizeof(struct rx_buf) <= RXBUF_SIZE, "RXBUF_SIZE too small");
+
+static struct {
+	pthread_mutex_t lock;
+	struct rx_buf *bufs[RXBUF_POOL_MAX];
+	size_t cnt;
+} rx_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct rx_buf *rxbuf_get(void)
+{
+	struct rx_buf *rb = NULL;
+	pthread_mutex_lock(&rx_pool.lock);
+	if (rx_pool.cnt > 0)
+		rb = rx_pool.bufs[--rx_pool.cnt];
+	pthread_mutex_unlock(&rx_pool.lock);
+	if (!rb)
+		rb = aligned_alloc(RXBUF_SIZE, RXBUF_SIZE);
+	return rb;
+}
+
+static void rxbuf_put(struct rx_buf *rb)
+{
+	pthread_mutex_lock(&rx_pool.lock);
+	if (rx_pool.cnt < RXBUF_POOL_MAX) {
+		rx_pool.bufs[rx_pool.cnt++] = rb;
+		rb = NULL;
+	}
+	pthread_mutex_unlock(&rx_pool.lock);
+	free(rb);
+}
+
+static struct rx_buf *rxbuf_of(const void *ptr)
+{
+	return (struct rx_buf *)((uintptr_t)ptr & ~(uintptr_t)(RXBUF_SIZE - 1));
+}
+
+// Release a message and the buffer it lives in
+static void message_put(struct message *mess)
 {
-	struct message *mess = ptr;
-	free(mess->buf);
+	rxbuf_put(rxbuf_of(mess));
 }
 
-static void init_message(struct message *mess, const uint8_t *buf,
+// buf must point into the rx_buf of mess. The message sits at the start of
+// its buffer, so list_free can free() it with no ff of its own.
+static void init_message(struct message *mess, uint32_t seq_no, uint8_t *buf,
 			 size_t buf_len, const struct sockaddr_in *addr,
 			 socklen_t addr_len)
 {
-	mess->buf = malloc(buf_len);
-	memcpy(mess->buf, buf, buf_len);
+	mess->seq_no = seq_no;
+	mess->buf = buf;
 	mess->buf_len = buf_len;
-	mess->ff = free_message;
+	mess->ff = NULL;
 	list_init(&mess->head);
 	memcpy(&mess->addr, addr, sizeof(*addr));
 	mess->addr_len = addr_len;
@@ -152,9 +263,23 @@ static void message_list_insert(struct message_list *list, struct message *msg)
 	pthread_mutex_unlock(&list->lock);
 }
 
-// Global to store messages which have been received
-// but not yet sent to upper layer.
-struct message_list received_message;
+// Per peer state of one stream
+struct stream_state {
+	uint32_t send_seq;
+	uint32_t recv_next;
+	// Messages which arrived ahead of recv_next, sorted by seq_no
+	struct list_head *reorder;
+	// Our unacknowledged messages, oldest first
+	struct list_head *unacked;
+	// The peer acknowledged a frame which carried our epoch, so the
+	// frames on this stream can leave it out
+	bool epoch_acked;
+	// recv_next was taken from a frame of the peer's current epoch
+	bool recv_synced;
+};
+
+// Oldest sequence number the peer may still be waiting for
+static uint32_t stream_snd_una(struct stream_state *st);
 
 struct bucket {
 	int entry_cnt;
@@ -190,12 +315,72 @@ static void init_hashtable(struct hashtable *tbl)
 		pthread_rwlock_destroy(&(tbl)->lock);                          \
 	} while (0);
 
+// Message body, shared by every peer's unacknowledged copy of it
+struct payload {
+	uint8_t *data;
+	size_t len;
+	int refcnt;
+	// Called with owner once the last reference is gone, with status 0
+	// if every peer acknowledged it and -1 if it was given up on
+	mrp_done_fn release;
+	void *owner;
+	int status;
+};
+
+static struct payload *payload_new(const uint8_t *buf, size_t len)
+{
+	struct payload *pl = malloc(sizeof(*pl) + len);
+	if (!pl)
+		return NULL;
+	pl->data = (uint8_t *)(pl + 1);
+	memcpy(pl->data, buf, len);
+	pl->len = len;
+	pl->refcnt = 1;
+	pl->release = NULL;
+	pl->owner = NULL;
+	pl->status = 0;
+	return pl;
+}
+
+// Payload pointing at data which stays valid until release(owner)
+static struct payload *payload_wrap(uint8_t *data, size_t len,
+				    mrp_done_fn release, void *owner)
+{
+	struct payload *pl = malloc(sizeof(*pl));
+	if (!pl)
+		return NULL;
+	pl->data = data;
+	pl->len = len;
+	pl->refcnt = 1;
+	pl->release = release;
+	pl->owner = owner;
+	pl->status = 0;
+	return pl;
+}
+
+static void payload_get(struct payload *pl)
+{
+	__atomic_add_fetch(&pl->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void payload_put(struct payload *pl)
+{
+	if (__atomic_sub_fetch(&pl->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (pl->release)
+			pl->release(pl->owner, pl->status);
+		free(pl);
+	}
+}
+
 struct unack_mess {
 	uint32_t seq_no;
-	uint8_t *buf;
-	size_t buf_len;
-	time_t send_time;
+	uint8_t stream;
+	struct stream_state *st;
+	struct payload *payload;
+	uint64_t send_time;
 	struct list_head head;
+	// Link in st->unacked
+	struct list_head stream_node;
 	struct sockaddr_in addr;
 	socklen_t addr_len;
 	free_func ff;
@@ -204,30 +389,58 @@ struct unack_mess {
 static void free_unack_mess(void *ptr)
 {
 	struct unack_mess *mess = ptr;
-	free(mess->buf);
+	payload_put(mess->payload);
 }
 
 static void init_unack_mess(struct unack_mess *mess, uint32_t seq_no,
-			    const uint8_t *buf, size_t buf_len,
+			    uint8_t stream, struct stream_state *st,
+			    struct payload *payload, uint64_t now,
 			    const struct sockaddr_in *addr, socklen_t addr_len)
 {
 	mess->seq_no = seq_no;
-	mess->buf = malloc(buf_len);
-	memcpy(mess->buf, buf, buf_len);
-	mess->buf_len = buf_len;
-	mess->send_time = time(NULL);
+	mess->stream = stream;
+	mess->st = st;
+	payload_get(payload);
+	mess->payload = payload;
+	mess->send_time = now;
 	list_init(&mess->head);
 	memcpy(&mess->addr, addr, sizeof(*addr));
 	mess->addr_len = addr_len;
 	mess->ff = free_unack_mess;
 }
 
-// Global to hold unacknowledged messages
-struct hashtable unacknowledged_messages;
+static bool same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+	       a->sin_port == b->sin_port;
+}
+
+static int addr_hash(const struct sockaddr_in *addr)
+{
+	uint32_t h = addr->sin_addr.s_addr;
+	h = h * 31 + addr->sin_port;
+	return h % NUM_BUCKETS;
+}
+
+// Every peer and stream numbers its messages from 0, so the sequence
+// number alone would pile them all into the same few buckets
+static int unack_hash(uint32_t seq_no, uint8_t stream,
+		      const struct sockaddr_in *addr)
+{
+	uint32_t h = seq_no;
+	h = h * 31 + stream;
+	h = h * 31 + addr->sin_addr.s_addr;
+	h = h * 31 + addr->sin_port;
+	return h % NUM_BUCKETS;
+}
 
-void hashtable_insert_message(struct hashtable *table, struct unack_mess *mess)
+// The insert and delete functions also maintain the per stream unacked
+// lists, so they must be called with the peer table lock held.
+static void hashtable_insert_message(struct hashtable *table,
+				     struct unack_mess *mess)
 {
-	int idx = mess->seq_no % NUM_BUCKETS;
+	list_push_back(&mess->st->unacked, &mess->stream_node);
+	int idx = unack_hash(mess->seq_no, mess->stream, &mess->addr);
 	pthread_rwlock_wrlock(&table->lock);
 	struct bucket *bkt = &table->buckets[idx];
 	if (bkt->entries)
@@ -238,9 +451,11 @@ void hashtable_insert_message(struct hashtable *table, struct unack_mess *mess)
 	pthread_rwlock_unlock(&table->lock);
 }
 
-void hashtable_delete_message(struct hashtable *table, uint32_t seq_no)
+static void hashtable_delete_message(struct hashtable *table, uint32_t seq_no,
+				     uint8_t stream,
+				     const struct sockaddr_in *addr)
 {
-	int idx = seq_no % NUM_BUCKETS;
+	int idx = unack_hash(seq_no, stream, addr);
 	pthread_rwlock_wrlock(&table->lock);
 	struct bucket *bkt = &table->buckets[idx];
 	if (bkt->entry_cnt == 0)
@@ -250,11 +465,16 @@ void hashtable_delete_message(struct hashtable *table, uint32_t seq_no)
 	do {
 		struct unack_mess *msg =
 		    list_entry(ptr, struct unack_mess, head);
-		if (msg->seq_no == seq_no) {
-			if (bkt->entry_cnt == 1)
+		if (msg->seq_no == seq_no && msg->stream == stream &&
+		    same_addr(&msg->addr, addr)) {
+			if (bkt->entry_cnt == 1) {
 				bkt->entries = NULL;
-			else
+			} else {
+				if (ptr == bkt->entries)
+					bkt->entries = ptr->next;
 				list_del(ptr);
+			}
+			list_unlink(&msg->st->unacked, &msg->stream_node);
 			free_unack_mess(msg);
 			free(msg);
 			bkt->entry_cnt--;
@@ -266,211 +486,2110 @@ del_mess_exit:
 	pthread_rwlock_unlock(&table->lock);
 }
 
-int curr_fd = -1;
+static size_t hashtable_cnt(struct hashtable *table)
+{
+	size_t cnt = 0;
+	pthread_rwlock_rdlock(&table->lock);
+	for (int i = 0; i < NUM_BUCKETS; i++)
+		cnt += table->buckets[i].entry_cnt;
+	pthread_rwlock_unlock(&table->lock);
+	return cnt;
+}
 
-enum __attribute__((packed)) message_type {
-	MT_Data,
-	MT_Ack,
+static uint32_t stream_snd_una(struct stream_state *st)
+{
+	if (!st->unacked)
+		return st->send_seq;
+	return list_entry(st->unacked, struct unack_mess, stream_node)->seq_no;
+}
+
+struct peer {
+	struct sockaddr_in addr;
+	struct stream_state streams[MRP_MAX_STREAMS];
+	// Epoch of the peer's association, once one of its frames carried it
+	uint32_t epoch;
+	bool has_epoch;
+	struct list_head head;
+	free_func ff;
 };
 
-// Thread R
-static void *receiver_thread(__attribute__((unused)) void *data)
+static void free_peer(void *ptr)
 {
-	static uint8_t buf[RECV_BUF_SIZE];
-	const size_t min_mess_size = 4 + sizeof(enum message_type);
-	for (;;) {
-		struct sockaddr_in addr;
-		socklen_t addr_len = sizeof(addr);
-		ssize_t ret = recvfrom(curr_fd, buf, sizeof(buf), 0,
-				       (struct sockaddr *)&addr, &addr_len);
+	struct peer *peer = ptr;
+	for (int i = 0; i < MRP_MAX_STREAMS; i++) {
+		if (peer->streams[i].reorder)
+			list_free(peer->streams[i].reorder, struct message,
+				  head);
+	}
+}
 
-		if (ret == -1)
-			continue;
-		// Message must contain at least seqence number and type
-		// Drop packet if not satisfied
-		if (ret < (ssize_t)min_mess_size)
-			continue;
-		// Fake unreliability
-		if (dropMessage(DROP_PROBABILITY))
-			continue;
+struct peer_table {
+	struct bucket buckets[NUM_BUCKETS];
+	pthread_mutex_t lock;
+};
 
-		uint32_t seq_no;
-		enum message_type type;
-		memcpy(&seq_no, buf, 4);
-		memcpy(&type, buf + 4, sizeof(type));
-
-		if (type == MT_Data) {
-			// Received data packet
-			// printf("Received DATA %d\n", seq_no);
-			struct message *msg = malloc(sizeof(*msg));
-			init_message(msg, buf + min_mess_size,
-				     ret - min_mess_size, &addr, addr_len);
-			message_list_insert(&received_message, msg);
-			// Send out ACK
-			memcpy(buf, &seq_no, 4);
-			type = MT_Ack;
-			memcpy(buf + 4, &type, sizeof(type));
-
-			// printf("sockfd = %d\n", curr_fd);
-			// printf("Send addr: %s:%d, Addr len: %u\n",
-			//        inet_ntoa(addr.sin_addr),
-			//        ntohs(addr.sin_port), addr_len);
-			int ret =
-			    sendto(curr_fd, buf, min_mess_size, 0,
-				   (const struct sockaddr *)&addr, addr_len);
-			// printf("Sent ACK %d\n", seq_no);
-			if (ret == -1) {
-				perror("sendto failed in ack");
-				exit(1);
-			}
-		} else if (type == MT_Ack) {
-			// Recevied ack packet
-			hashtable_delete_message(&unacknowledged_messages,
-						 seq_no);
-			// printf("Received ACK %d\n", seq_no);
-		}
+static void init_peer_table(struct peer_table *tbl)
+{
+	for (int i = 0; i < NUM_BUCKETS; i++)
+		init_bucket(&tbl->buckets[i]);
+	pthread_mutex_init(&tbl->lock, NULL);
+}
+
+static void free_peer_table(struct peer_table *tbl)
+{
+	for (int i = 0; i < NUM_BUCKETS; i++) {
+		struct bucket *bkt = &tbl->buckets[i];
+		if (bkt->entries)
+			list_free(bkt->entries, struct peer, head);
 	}
-	unreachable("Receiver thread shouldn't exit");
+	pthread_mutex_destroy(&tbl->lock);
 }
 
-static ssize_t send_message(uint32_t seq_num, const uint8_t *data, size_t cnt,
-			    int sockfd, int flags, const struct sockaddr *from,
-			    socklen_t addrlen)
+// Find the state of a peer, creating it on first contact.
+// Must be called with tbl->lock held.
+static struct peer *peer_table_get(struct peer_table *tbl,
+				   const struct sockaddr_in *addr,
+				   uint32_t initial_seq)
 {
-	const enum message_type type = MT_Data;
+	struct bucket *bkt = &tbl->buckets[addr_hash(addr)];
+	if (bkt->entries) {
+		struct list_head *ptr = bkt->entries;
+		do {
+			struct peer *peer = list_entry(ptr, struct peer, head);
+			if (same_addr(&peer->addr, addr))
+				return peer;
+			ptr = ptr->next;
+		} while (ptr != bkt->entries);
+	}
 
-	size_t req_len = cnt + 4 + sizeof(enum message_type);
-	uint8_t *mess_buf = malloc(req_len);
-	memcpy(mess_buf, &seq_num, 4);
-	memcpy(mess_buf + 4, &type, sizeof(type));
-	memcpy(mess_buf + 4 + sizeof(type), data, cnt);
+	struct peer *peer = calloc(1, sizeof(*peer));
+	if (!peer)
+		return NULL;
+	peer->addr = *addr;
+	for (int i = 0; i < MRP_MAX_STREAMS; i++) {
+		peer->streams[i].send_seq = initial_seq;
+		peer->streams[i].recv_next = initial_seq;
+	}
+	peer->ff = free_peer;
+	list_init(&peer->head);
+	if (bkt->entries)
+		list_add(bkt->entries, &peer->head);
+	else
+		bkt->entries = &peer->head;
+	bkt->entry_cnt++;
+	return peer;
+}
 
-	// printf("sockfd = %d\n", sockfd);
-	ssize_t ret = sendto(sockfd, mess_buf, req_len, flags, from, addrlen);
-	// printf("Send addr: %s:%d, Addr len: %u\n",
-	//    inet_ntoa(((const struct sockaddr_in *)from)->sin_addr),
-	//    ntohs(((const struct sockaddr_in *)from)->sin_port), addrlen);
-	if (ret == -1) {
-		perror("Failed to sendto while resend");
-		exit(1);
+// Buffer a message which arrived ahead of its turn. Returns false if a
+// message with the same sequence number is already buffered.
+static bool reorder_insert(struct stream_state *st, struct message *msg)
+{
+	if (!st->reorder) {
+		st->reorder = &msg->head;
+		return true;
 	}
-	free(mess_buf);
-	return ret;
+	struct list_head *ptr = st->reorder;
+	bool new_first = true;
+	do {
+		struct message *cur = list_entry(ptr, struct message, head);
+		if (cur->seq_no == msg->seq_no)
+			return false;
+		if (seq_gt(cur->seq_no, msg->seq_no))
+			break;
+		new_first = false;
+		ptr = ptr->next;
+	} while (ptr != st->reorder);
+	list_add_tail(ptr, &msg->head);
+	if (new_first)
+		st->reorder = &msg->head;
+	return true;
 }
 
-static void scan_table_for_resend(struct hashtable *tbl)
+// Pop the first buffered message if it is the next one in order
+static struct message *reorder_pop_next(struct stream_state *st)
 {
-	pthread_rwlock_rdlock(&tbl->lock);
-	for (int idx = 0; idx < NUM_BUCKETS; idx++) {
-		struct list_head *head = tbl->buckets[idx].entries;
+	if (!st->reorder)
+		return NULL;
+	struct message *msg = list_entry(st->reorder, struct message, head);
+	if (msg->seq_no != st->recv_next)
+		return NULL;
+	if (st->reorder->next == st->reorder) {
+		st->reorder = NULL;
+	} else {
+		struct list_head *next = st->reorder->next;
+		list_del(st->reorder);
+		st->reorder = next;
+	}
+	list_init(&msg->head);
+	return msg;
+}
+
+// CRC32C (Castagnoli), as used by iSCSI and SCTP. The SSE4.2 crc32
+// instruction handles 8 bytes per step, a table is the fallback.
+static uint32_t crc32c_table[256];
+
+static void crc32c_init_table(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = crc >> 1 ^ (0x82f63b78 & -(crc & 1));
+		crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		crc = crc >> 8 ^ crc32c_table[(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64 = crc;
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+	crc = crc64;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#endif
+
+uint32_t mrp_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	typedef uint32_t (*crc32c_fn)(uint32_t, const uint8_t *, size_t);
+	static crc32c_fn impl;
+	crc32c_fn fn = __atomic_load_n(&impl, __ATOMIC_ACQUIRE);
+	if (!fn) {
+		fn = crc32c_sw;
+		crc32c_init_table();
+#if defined(__x86_64__)
+		if (__builtin_cpu_supports("sse4.2"))
+			fn = crc32c_sse42;
+#endif
+		__atomic_store_n(&impl, fn, __ATOMIC_RELEASE);
+	}
+	return ~fn(~crc, buf, len);
+}
+
+enum __attribute__((packed)) message_type {
+	MT_Data,
+	MT_Ack,
+	// The receiver does not know where the stream starts, see below
+	MT_Reset,
+};
+
+// A frame starts with a type byte:
+//   bits 0-1  message type
+//   bit 2     an epoch and a base sequence number follow the stream id
+//   bits 4-5  length of the sequence number field minus one
+//   bit 6     the frame ends in a CRC32C of everything before it
+//   bit 7     a stream id byte follows, left out for stream 0
+// followed by the low bytes of the sequence number, most significant first.
+// The receiver expands a truncated sequence number to the value closest to
+// the one it expects, so the sender only truncates while all its
+// unacknowledged messages on the stream fit in a quarter of the range, see
+// seq_in_window.
+//
+// The epoch is picked at random when an engine is created. Data frames
+// carry it until the peer has acknowledged one of them, together with a
+// base, the oldest sequence number still unacknowledged on the stream.
+// The ACK of such a frame echoes the block. A receiver without state of a
+// stream under the sender's current epoch, because the sender's epoch
+// changed or because the receiver itself restarted, starts the stream at
+// the base, as everything before it has been acknowledged. It answers data
+// frames without an epoch on such a stream with MT_Reset, after which the
+// sender puts the block back into its frames.
+#define MT_TYPE_MASK 0x03
+#define MT_F_Epoch 0x04
+#define MT_SEQ_LEN_SHIFT 4
+#define MT_F_Crc 0x40
+#define MT_F_Stream 0x80
+
+// Type byte and a one byte sequence number
+#define HDR_MIN 2
+// Type byte, stream id, epoch, base and a full sequence number
+#define HDR_MAX 14
+// The epoch and the base, four bytes each, most significant byte first
+#define EPOCH_LEN 8
+// The CRC32C trailer, most significant byte first
+#define CRC_LEN 4
+// Room for a header and its trailer, which build_frame keeps side by side
+#define HDR_BUF (HDR_MAX + CRC_LEN)
+
+struct mrp_engine {
+	// Messages which have been received but not yet sent to upper
+	// layer, one queue per stream.
+	struct message_list received_message[MRP_MAX_STREAMS];
+	// Messages which have been sent but not yet acknowledged.
+	struct hashtable unacknowledged_messages;
+	struct peer_table peers;
+	int priority[MRP_MAX_STREAMS];
+	// Signalled whenever messages are delivered to a queue
+	pthread_mutex_t recv_lock;
+	pthread_cond_t recv_cond;
+	void (*recv_notify)(void *ctx);
+	void *recv_notify_ctx;
+	// Signalled when messages are acknowledged while someone flushes
+	pthread_mutex_t ack_lock;
+	pthread_cond_t ack_cond;
+	int flush_waiters;
+	struct mrp_clock clock;
+	struct mrp_io io;
+	float drop_prob;
+	// Options
+	bool compact;
+	bool checksum;
+	uint32_t initial_seq;
+	uint32_t epoch;
+};
+
+// Whatever is still unacknowledged now never will be
+static void fail_unacked(struct hashtable *tbl)
+{
+	for (int i = 0; i < NUM_BUCKETS; i++) {
+		struct list_head *head = tbl->buckets[i].entries, *ptr = head;
 		if (!head)
 			continue;
-		struct list_head *ptr = head;
 		do {
 			struct unack_mess *msg =
 			    list_entry(ptr, struct unack_mess, head);
-			time_t now = time(NULL);
-			if (now - msg->send_time >= TIMEOUT) {
-				send_message(
-				    msg->seq_no, msg->buf, msg->buf_len,
-				    curr_fd, 0,
-				    (const struct sockaddr *)&msg->addr,
-				    msg->addr_len);
-				// printf("Resent DATA %d\n", msg->seq_no);
-
-				msg->send_time = now;
-			}
+			msg->payload->status = -1;
 			ptr = ptr->next;
 		} while (ptr != head);
 	}
-	pthread_rwlock_unlock(&tbl->lock);
 }
 
-// Thread S
-static void *resender_thread(__attribute__((unused)) void *data)
+// An epoch which a restarted process is unlikely to pick again
+static uint32_t random_epoch(void)
 {
-	for (;;) {
-		sleep(T);
-		scan_table_for_resend(&unacknowledged_messages);
+	uint32_t epoch;
+	if (getrandom(&epoch, sizeof(epoch), GRND_NONBLOCK) == sizeof(epoch))
+		return epoch;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec ^ ts.tv_nsec ^ (uint32_t)getpid() << 16;
+}
+
+struct mrp_engine *mrp_engine_new(const struct mrp_clock *clock,
+				  const struct mrp_io *io, float drop_prob)
+{
+	struct mrp_engine *eng = malloc(sizeof(*eng));
+	if (!eng)
+		return NULL;
+	for (int i = 0; i < MRP_MAX_STREAMS; i++) {
+		init_message_list(&eng->received_message[i]);
+		eng->priority[i] = 0;
 	}
-	unreachable("resender loop should never exit");
+	init_hashtable(&eng->unacknowledged_messages);
+	init_peer_table(&eng->peers);
+	pthread_mutex_init(&eng->recv_lock, NULL);
+	pthread_cond_init(&eng->recv_cond, NULL);
+	pthread_mutex_init(&eng->ack_lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&eng->ack_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	eng->flush_waiters = 0;
+	eng->recv_notify = NULL;
+	eng->recv_notify_ctx = NULL;
+	eng->clock = *clock;
+	eng->io = *io;
+	eng->drop_prob = drop_prob;
+	eng->compact = false;
+	eng->checksum = false;
+	eng->initial_seq = 0;
+	eng->epoch = random_epoch();
+	return eng;
 }
 
-pthread_t rcv_tid;
-pthread_t snd_tid;
+void mrp_engine_free(struct mrp_engine *eng)
+{
+	for (int i = 0; i < MRP_MAX_STREAMS; i++)
+		free_message_list(&eng->received_message[i]);
+	fail_unacked(&eng->unacknowledged_messages);
+	free_hashtable(&eng->unacknowledged_messages, struct unack_mess, head);
+	free_peer_table(&eng->peers);
+	pthread_mutex_destroy(&eng->recv_lock);
+	pthread_cond_destroy(&eng->recv_cond);
+	pthread_mutex_destroy(&eng->ack_lock);
+	pthread_cond_destroy(&eng->ack_cond);
+	free(eng);
+}
 
-int r_socket(int family, int type, int protocol)
+static uint64_t engine_now(struct mrp_engine *eng)
 {
-	if (type != SOCK_MRP) {
-		errno = EINVAL;
-		return -1;
+	return eng->clock.now_ms(eng->clock.ctx);
+}
+
+// Bytes of sequence number to send for a message on st. The messages in
+// flight must span less than a quarter of the truncated range, see
+// seq_in_window.
+static int seq_len(struct mrp_engine *eng, struct stream_state *st)
+{
+	if (!eng->compact)
+		return 4;
+	uint32_t span = st->send_seq - stream_snd_una(st) + 1;
+	int len = 1;
+	while (len < 4 && span >= (1u << (8 * len - 2)))
+		len++;
+	return len;
+}
+
+// Expand a sequence number truncated to len bytes to the value closest to
+// expected
+static uint32_t seq_expand(uint32_t trunc, int len, uint32_t expected)
+{
+	if (len == 4)
+		return trunc;
+	uint32_t win = 1u << (8 * len), half = win / 2;
+	uint32_t seq = (expected & ~(win - 1)) | trunc;
+	if (!seq_gt(seq + half, expected))
+		seq += win;
+	else if (seq_gt(seq, expected + half))
+		seq -= win;
+	return seq;
+}
+
+// Whether a message numbered seq, expanded from len bytes around
+// recv_next, may be held back and acknowledged. Nothing is taken more than
+// RECV_WINDOW ahead, the sender retransmits it once the gap has closed.
+// Compact numbers are also only taken less than a quarter of their range
+// ahead. The sender's messages in flight lie there, as everything before
+// recv_next was acknowledged. A number further ahead is a duplicate which
+// the network held back while more than three quarters of the range was
+// sent, and which expanded into the future.
+static bool seq_in_window(uint32_t seq, int len, uint32_t recv_next)
+{
+	uint32_t win = RECV_WINDOW;
+	if (len < 4)
+		win = MIN(win, 1u << (8 * len - 2));
+	return seq_lt(seq, recv_next + win);
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// The epoch block of a frame
+struct frame_epoch {
+	uint32_t epoch;
+	uint32_t base;
+};
+
+// Our epoch block for st in fe while the peer may not know our epoch yet,
+// NULL once it does
+static const struct frame_epoch *stream_epoch(struct mrp_engine *eng,
+					      struct stream_state *st,
+					      struct frame_epoch *fe)
+{
+	if (st->epoch_acked)
+		return NULL;
+	fe->epoch = eng->epoch;
+	fe->base = stream_snd_una(st);
+	return fe;
+}
+
+// Fill in hdr, which must have room for HDR_BUF bytes, and point frame at
+// it and the payload, which is not copied. With crc the trailer goes at
+// the end of hdr, as the last fragment.
+static void build_frame(struct mrp_frame *frame, uint8_t *hdr, bool crc,
+			const struct frame_epoch *epoch, uint32_t seq_num,
+			int seq_bytes, enum message_type type, uint8_t stream,
+			const uint8_t *data, size_t cnt,
+			const struct sockaddr_in *to, socklen_t addrlen)
+{
+	size_t hdr_len = 1;
+	hdr[0] = type | (seq_bytes - 1) << MT_SEQ_LEN_SHIFT;
+	if (stream != 0) {
+		hdr[0] |= MT_F_Stream;
+		hdr[hdr_len++] = stream;
 	}
-	int fd = socket(family, SOCK_DGRAM, protocol);
-	if (fd == -1)
-		return -1;
+	if (epoch) {
+		hdr[0] |= MT_F_Epoch;
+		put_be32(hdr + hdr_len, epoch->epoch);
+		put_be32(hdr + hdr_len + 4, epoch->base);
+		hdr_len += EPOCH_LEN;
+	}
+	for (int i = seq_bytes - 1; i >= 0; i--)
+		hdr[hdr_len++] = seq_num >> (8 * i);
 
-	// Setup threads and data structures
-	init_message_list(&received_message);
-	init_hashtable(&unacknowledged_messages);
-	curr_fd = fd;
-	pthread_create(&rcv_tid, NULL, receiver_thread, NULL);
-	pthread_create(&snd_tid, NULL, resender_thread, NULL);
+	frame->iov[0].iov_base = hdr;
+	frame->iov[0].iov_len = hdr_len;
+	frame->iov[1].iov_base = (void *)data;
+	frame->iov[1].iov_len = cnt;
+	frame->iovcnt = cnt ? 2 : 1;
+	if (crc) {
+		hdr[0] |= MT_F_Crc;
+		uint8_t *trailer = hdr + HDR_MAX;
+		uint32_t sum = mrp_crc32c(0, hdr, hdr_len);
+		put_be32(trailer, mrp_crc32c(sum, data, cnt));
+		frame->iov[frame->iovcnt].iov_base = trailer;
+		frame->iov[frame->iovcnt].iov_len = CRC_LEN;
+		frame->iovcnt++;
+	}
+	frame->to = to;
+	frame->to_len = addrlen;
+}
 
-	// Seed rand for dropMessage
-	srand(time(NULL));
-	return fd;
+static ssize_t send_frame(struct mrp_engine *eng, bool crc,
+			  const struct frame_epoch *epoch, uint32_t seq_num,
+			  int seq_bytes, enum message_type type,
+			  uint8_t stream, const uint8_t *data, size_t cnt,
+			  const struct sockaddr_in *to, socklen_t addrlen)
+{
+	uint8_t hdr[HDR_BUF];
+	struct mrp_frame frame;
+	build_frame(&frame, hdr, crc, epoch, seq_num, seq_bytes, type, stream,
+		    data, cnt, to, addrlen);
+	return eng->io.send(eng->io.ctx, frame.iov, frame.iovcnt, to, addrlen);
 }
 
-int r_bind(int sockfd, const struct sockaddr *addr, socklen_t addr_len)
+// Transmit frames, batched if the I/O layer can. Returns how many were
+// sent before the first failure.
+static size_t send_frames(struct mrp_engine *eng,
+			  const struct mrp_frame *frames, size_t cnt)
 {
-	return bind(sockfd, addr, addr_len);
+	size_t done = 0;
+	while (done < cnt) {
+		const struct mrp_frame *f = &frames[done];
+		if (eng->io.send_batch) {
+			unsigned int n = MIN(cnt - done, MRP_BATCH);
+			int ret = eng->io.send_batch(eng->io.ctx, f, n);
+			if (ret <= 0)
+				break;
+			done += ret;
+		} else {
+			if (eng->io.send(eng->io.ctx, f->iov, f->iovcnt, f->to,
+					 f->to_len) == -1)
+				break;
+			done++;
+		}
+	}
+	return done;
 }
 
-int r_close(int sockfd)
+// A data frame of the peer carried its epoch. A new one means that the
+// peer restarted, and what we remember of the old association would turn
+// the messages of the new one into duplicates. Its streams start over from
+// the base of their next frame with the epoch, and the new association has
+// to learn our epoch as well.
+static void peer_set_epoch(struct peer *peer, uint32_t epoch)
 {
-	pthread_cancel(rcv_tid);
-	pthread_cancel(snd_tid);
-	free_message_list(&received_message);
-	free_hashtable(&unacknowledged_messages, struct unack_mess, head);
-	return close(sockfd);
+	if (peer->has_epoch && peer->epoch == epoch)
+		return;
+	for (int i = 0; i < MRP_MAX_STREAMS; i++) {
+		struct stream_state *st = &peer->streams[i];
+		st->recv_synced = false;
+		while (st->reorder) {
+			struct list_head *ptr = st->reorder;
+			st->reorder = ptr->next == ptr ? NULL : ptr->next;
+			list_del(ptr);
+			message_put(list_entry(ptr, struct message, head));
+		}
+		st->epoch_acked = false;
+	}
+	peer->epoch = epoch;
+	peer->has_epoch = true;
 }
 
-ssize_t r_sendto(int sockfd, const void *buff, size_t nbytes, int flags,
-		 const struct sockaddr *to, socklen_t addrlen)
+// What to answer a data frame with
+enum rx_reply {
+	RX_Ack,
+	RX_None,
+	RX_Reset,
+};
+
+// Hand a data message to the upper layer in sequence order, holding back
+// anything which arrived early and dropping duplicates. msg->seq_no holds
+// the truncated sequence number on entry and the expanded one on return.
+// epoch is the block the frame carried, if any. The message is only to be
+// acknowledged if it was accounted for.
+static enum rx_reply deliver_in_order(struct mrp_engine *eng, uint8_t stream,
+				      int seq_bytes,
+				      const struct frame_epoch *epoch,
+				      struct message *msg)
 {
-	static uint32_t seq_num = 0;
+	struct message_list *queue = &eng->received_message[stream];
+	enum rx_reply reply = RX_None;
+	bool delivered = false;
 
-	ssize_t ret =
-	    send_message(seq_num, buff, nbytes, sockfd, flags, to, addrlen);
-	if (ret == -1)
-		return -1;
-	struct unack_mess *mess = malloc(sizeof(*mess));
-	init_unack_mess(mess, seq_num, buff, nbytes,
-			(const struct sockaddr_in *)to, addrlen);
-	hashtable_insert_message(&unacknowledged_messages, mess);
-	seq_num++;
+	pthread_mutex_lock(&eng->peers.lock);
+	struct peer *peer =
+	    peer_table_get(&eng->peers, &msg->addr, eng->initial_seq);
+	if (!peer)
+		goto drop;
+	if (epoch)
+		peer_set_epoch(peer, epoch->epoch);
+	struct stream_state *st = &peer->streams[stream];
+	if (!st->recv_synced) {
+		// Without the base we cannot tell where the stream starts
+		if (!epoch) {
+			reply = RX_Reset;
+			goto drop;
+		}
+		st->recv_next = epoch->base;
+		st->recv_synced = true;
+	}
+	msg->seq_no = seq_expand(msg->seq_no, seq_bytes, st->recv_next);
+	if (!seq_in_window(msg->seq_no, seq_bytes, st->recv_next))
+		goto drop;
+	if (msg->seq_no == st->recv_next) {
+		message_list_insert(queue, msg);
+		st->recv_next++;
+		while ((msg = reorder_pop_next(st))) {
+			message_list_insert(queue, msg);
+			st->recv_next++;
+		}
+		delivered = true;
+	} else if (seq_lt(msg->seq_no, st->recv_next) ||
+		   !reorder_insert(st, msg)) {
+		// Retransmission of something we already have, our ACK
+		// must have been lost
+		message_put(msg);
+	}
+	pthread_mutex_unlock(&eng->peers.lock);
 
-	return ret;
+	if (delivered) {
+		pthread_mutex_lock(&eng->recv_lock);
+		pthread_cond_broadcast(&eng->recv_cond);
+		pthread_mutex_unlock(&eng->recv_lock);
+		if (eng->recv_notify)
+			eng->recv_notify(eng->recv_notify_ctx);
+	}
+	return RX_Ack;
+
+drop:
+	pthread_mutex_unlock(&eng->peers.lock);
+	message_put(msg);
+	return reply;
 }
 
-ssize_t r_recvfrom(__attribute__((unused)) int sockfd, void *buf, size_t nbytes,
-		   __attribute__((unused)) int flags, struct sockaddr *from,
-		   socklen_t *addr_len)
+// Wake up mrp_engine_flush, if anyone is in it
+static void unacked_removed(struct mrp_engine *eng)
 {
-	const int sleep_time = 1;
-	while (message_list_cnt(&received_message) == 0)
-		sleep(sleep_time);
-	struct message *msg = message_list_pop_first(&received_message);
-	ssize_t len = (size_t)MIN(nbytes, msg->buf_len);
-	memcpy(buf, msg->buf, len);
+	if (__atomic_load_n(&eng->flush_waiters, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&eng->ack_lock);
+	pthread_cond_broadcast(&eng->ack_cond);
+	pthread_mutex_unlock(&eng->ack_lock);
+}
 
-	*from = *(struct sockaddr *)&msg->addr;
-	*addr_len = msg->addr_len;
+// epoch is the block the ACK echoed from the frame it acknowledges, if any
+static void handle_ack(struct mrp_engine *eng, uint8_t stream,
+		       uint32_t seq_no, int seq_bytes,
+		       const struct frame_epoch *epoch,
+		       const struct sockaddr_in *from)
+{
+	pthread_mutex_lock(&eng->peers.lock);
+	struct peer *peer = peer_table_get(&eng->peers, from, eng->initial_seq);
+	if (peer) {
+		// An ACK is for one of our unacknowledged messages, which all
+		// lie within a quarter of the truncated range after the oldest
+		struct stream_state *st = &peer->streams[stream];
+		if (epoch && epoch->epoch == eng->epoch)
+			st->epoch_acked = true;
+		seq_no = seq_expand(seq_no, seq_bytes, stream_snd_una(st));
+		hashtable_delete_message(&eng->unacknowledged_messages, seq_no,
+					 stream, from);
+	}
+	pthread_mutex_unlock(&eng->peers.lock);
+	unacked_removed(eng);
+}
 
-	free_message(msg);
-	free(msg);
+// The peer has no state of ours for a stream, most likely because it
+// restarted, and then it has none for any of them. Our frames carry the
+// epoch block again until it acknowledges one.
+static void handle_reset(struct mrp_engine *eng,
+			 const struct sockaddr_in *from)
+{
+	pthread_mutex_lock(&eng->peers.lock);
+	struct peer *peer = peer_table_get(&eng->peers, from, eng->initial_seq);
+	for (int i = 0; peer && i < MRP_MAX_STREAMS; i++)
+		peer->streams[i].epoch_acked = false;
+	pthread_mutex_unlock(&eng->peers.lock);
+}
 
-	return len;
+// Handle one datagram received into rb. Returns true if a message now
+// holds on to rb.
+static bool engine_input(struct mrp_engine *eng, struct rx_buf *rb, size_t len,
+			 const struct sockaddr_in *from, socklen_t from_len)
+{
+	const uint8_t *buf = rb->data;
+	size_t hdr_len = 1;
+	uint8_t stream = 0;
+
+	// Message must contain at least seqence number and type
+	// Drop packet if not satisfied
+	if (len < HDR_MIN)
+		return false;
+	// Check the trailer before anything trusts the header. Once we
+	// checksum our frames we expect the peer to do the same.
+	if (buf[0] & MT_F_Crc) {
+		if (len < HDR_MIN + CRC_LEN)
+			return false;
+		len -= CRC_LEN;
+		if (mrp_crc32c(0, buf, len) != get_be32(buf + len))
+			return false;
+	} else if (eng->checksum) {
+		return false;
+	}
+	// Fake unreliability
+	if (eng->drop_prob > 0 && dropMessage(eng->drop_prob))
+		return false;
+
+	enum message_type type = buf[0] & MT_TYPE_MASK;
+	int seq_bytes = ((buf[0] >> MT_SEQ_LEN_SHIFT) & 0x3) + 1;
+	if (buf[0] & MT_F_Stream) {
+		stream = buf[hdr_len++];
+		if (stream >= MRP_MAX_STREAMS)
+			return false;
+	}
+	struct frame_epoch epoch_block;
+	const struct frame_epoch *epoch = NULL;
+	if (buf[0] & MT_F_Epoch) {
+		if (len < hdr_len + EPOCH_LEN)
+			return false;
+		epoch_block.epoch = get_be32(buf + hdr_len);
+		epoch_block.base = get_be32(buf + hdr_len + 4);
+		epoch = &epoch_block;
+		hdr_len += EPOCH_LEN;
+	}
+	// The application may release rb as soon as it is delivered
+	bool crc = eng->checksum || (buf[0] & MT_F_Crc);
+	if (len < hdr_len + seq_bytes)
+		return false;
+	uint32_t seq_no = 0;
+	for (int i = 0; i < seq_bytes; i++)
+		seq_no = seq_no << 8 | buf[hdr_len++];
+
+	if (type == MT_Data) {
+		// Received data packet, which takes over the buffer
+		init_message(&rb->msg, seq_no, rb->data + hdr_len,
+			     len - hdr_len, from, from_len);
+		enum rx_reply reply =
+		    deliver_in_order(eng, stream, seq_bytes, epoch, &rb->msg);
+		if (reply == RX_None)
+			return true;
+		// Send out ACK, echoing the sequence number as it came in and
+		// the epoch block, which tells the peer that its epoch arrived.
+		// A peer which checksums its frames wants checksummed ACKs.
+		if (send_frame(eng, crc, epoch, seq_no, seq_bytes,
+			       reply == RX_Ack ? MT_Ack : MT_Reset, stream, NULL,
+			       0, from, from_len) == -1) {
+			perror("sendto failed in ack");
+			exit(1);
+		}
+		return true;
+	} else if (type == MT_Ack) {
+		// Recevied ack packet
+		handle_ack(eng, stream, seq_no, seq_bytes, epoch, from);
+	} else if (type == MT_Reset) {
+		handle_reset(eng, from);
+	}
+	return false;
+}
+
+void mrp_engine_input(struct mrp_engine *eng, const uint8_t *buf, size_t len,
+		      const struct sockaddr_in *from, socklen_t from_len)
+{
+	if (len > RECV_BUF_SIZE)
+		return;
+	struct rx_buf *rb = rxbuf_get();
+	if (!rb)
+		return;
+	memcpy(rb->data, buf, len);
+	if (!engine_input(eng, rb, len, from, from_len))
+		rxbuf_put(rb);
+}
+
+struct due_mess {
+	struct unack_mess *msg;
+	int priority;
+};
+
+static int due_mess_cmp(const void *a, const void *b)
+{
+	const struct due_mess *x = a, *y = b;
+	if (x->priority != y->priority)
+		return y->priority - x->priority;
+	return seq_gt(x->msg->seq_no, y->msg->seq_no) -
+	       seq_lt(x->msg->seq_no, y->msg->seq_no);
+}
+
+// Retransmit timed out messages, higher priority streams first
+void mrp_engine_tick(struct mrp_engine *eng)
+{
+	struct hashtable *tbl = &eng->unacknowledged_messages;
+	const uint64_t timeout_ms = TIMEOUT * 1000ULL;
+	struct due_mess *due = NULL;
+	size_t due_cnt = 0, due_cap = 0;
+	uint64_t now = engine_now(eng);
+
+	pthread_mutex_lock(&eng->peers.lock);
+	pthread_rwlock_rdlock(&tbl->lock);
+	for (int idx = 0; idx < NUM_BUCKETS; idx++) {
+		struct list_head *head = tbl->buckets[idx].entries;
+		if (!head)
+			continue;
+		struct list_head *ptr = head;
+		do {
+			struct unack_mess *msg =
+			    list_entry(ptr, struct unack_mess, head);
+			ptr = ptr->next;
+			if (now - msg->send_time < timeout_ms)
+				continue;
+			if (due_cnt == due_cap) {
+				due_cap = due_cap ? 2 * due_cap : 64;
+				struct due_mess *tmp =
+				    realloc(due, due_cap * sizeof(*due));
+				if (!tmp)
+					break;
+				due = tmp;
+			}
+			due[due_cnt].msg = msg;
+			due[due_cnt].priority = eng->priority[msg->stream];
+			due_cnt++;
+		} while (ptr != head);
+	}
+
+	qsort(due, due_cnt, sizeof(*due), due_mess_cmp);
+	for (size_t base = 0; base < due_cnt; base += MRP_BATCH) {
+		struct mrp_frame frames[MRP_BATCH];
+		uint8_t hdrs[MRP_BATCH][HDR_BUF];
+		size_t cnt = MIN(due_cnt - base, MRP_BATCH);
+		for (size_t i = 0; i < cnt; i++) {
+			struct unack_mess *msg = due[base + i].msg;
+			struct frame_epoch fe;
+			build_frame(&frames[i], hdrs[i], eng->checksum,
+				    stream_epoch(eng, msg->st, &fe), msg->seq_no,
+				    seq_len(eng, msg->st), MT_Data, msg->stream,
+				    msg->payload->data, msg->payload->len,
+				    &msg->addr, msg->addr_len);
+			msg->send_time = now;
+		}
+		if (send_frames(eng, frames, cnt) != cnt) {
+			perror("Failed to sendto while resend");
+			exit(1);
+		}
+	}
+	pthread_rwlock_unlock(&tbl->lock);
+	pthread_mutex_unlock(&eng->peers.lock);
+	free(due);
+}
+
+// Send a payload and keep a reference to it until it is acknowledged
+static ssize_t engine_send_payload(struct mrp_engine *eng, uint8_t stream,
+				   struct payload *pl,
+				   const struct sockaddr_in *to,
+				   socklen_t to_len)
+{
+	if (stream >= MRP_MAX_STREAMS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// The peer lock is held until the frame is out, so a sequence number
+	// is only used up by a message which was actually sent. A hole would
+	// stall the stream at the receiver forever.
+	pthread_mutex_lock(&eng->peers.lock);
+	struct peer *peer = peer_table_get(&eng->peers, to, eng->initial_seq);
+	struct unack_mess *mess = malloc(sizeof(*mess));
+	if (!peer || !mess) {
+		pthread_mutex_unlock(&eng->peers.lock);
+		free(mess);
+		errno = ENOMEM;
+		return -1;
+	}
+	struct stream_state *st = &peer->streams[stream];
+	uint32_t seq_num = st->send_seq;
+	init_unack_mess(mess, seq_num, stream, st, pl, engine_now(eng), to,
+			to_len);
+	hashtable_insert_message(&eng->unacknowledged_messages, mess);
+	struct frame_epoch fe;
+	ssize_t ret = send_frame(eng, eng->checksum, stream_epoch(eng, st, &fe),
+				 seq_num, seq_len(eng, st), MT_Data, stream,
+				 pl->data, pl->len, to, to_len);
+	if (ret == -1)
+		hashtable_delete_message(&eng->unacknowledged_messages,
+					 seq_num, stream, to);
+	else
+		peer->streams[stream].send_seq++;
+	pthread_mutex_unlock(&eng->peers.lock);
+	if (ret == -1)
+		unacked_removed(eng);
+
+	return ret;
+}
+
+ssize_t mrp_engine_send(struct mrp_engine *eng, uint8_t stream,
+			const void *buf, size_t nbytes,
+			const struct sockaddr_in *to, socklen_t to_len)
+{
+	struct payload *pl = payload_new(buf, nbytes);
+	if (!pl) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ssize_t ret = engine_send_payload(eng, stream, pl, to, to_len);
+	payload_put(pl);
+	return ret;
+}
+
+ssize_t mrp_engine_send_notify(struct mrp_engine *eng, uint8_t stream,
+			       const void *buf, size_t nbytes,
+			       const struct sockaddr_in *to, socklen_t to_len,
+			       int flags, mrp_done_fn done, void *ctx)
+{
+	struct payload *pl;
+	if (flags & MRP_SEND_ZEROCOPY)
+		pl = payload_wrap((uint8_t *)buf, nbytes, done, ctx);
+	else if ((pl = payload_new(buf, nbytes))) {
+		pl->release = done;
+		pl->owner = ctx;
+	}
+	if (!pl) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ssize_t ret = engine_send_payload(eng, stream, pl, to, to_len);
+	// Nobody else holds the payload if the send failed, and the caller
+	// learns about that from the return value instead
+	if (ret == -1)
+		pl->release = NULL;
+	payload_put(pl);
+	return ret;
+}
+
+static int addr_cmp(const void *a, const void *b)
+{
+	const struct sockaddr_in *x = a, *y = b;
+	uint32_t xa = ntohl(x->sin_addr.s_addr), ya = ntohl(y->sin_addr.s_addr);
+	if (xa != ya)
+		return (xa > ya) - (xa < ya);
+	return ntohs(x->sin_port) - ntohs(y->sin_port);
+}
+
+// Fail with EINVAL if an address occurs twice in to. A peer listed twice
+// would be given the same sequence number for both copies.
+static int check_distinct(const struct sockaddr_in *to, size_t npeers)
+{
+	if (npeers < 2)
+		return 0;
+	struct sockaddr_in *sorted = malloc(npeers * sizeof(*sorted));
+	if (!sorted) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(sorted, to, npeers * sizeof(*sorted));
+	qsort(sorted, npeers, sizeof(*sorted), addr_cmp);
+	int ret = 0;
+	for (size_t i = 1; i < npeers && ret == 0; i++)
+		if (same_addr(&sorted[i - 1], &sorted[i])) {
+			errno = EINVAL;
+			ret = -1;
+		}
+	free(sorted);
+	return ret;
+}
+
+ssize_t mrp_engine_send_many(struct mrp_engine *eng, uint8_t stream,
+			     const void *buf, size_t nbytes,
+			     const struct sockaddr_in *to, size_t npeers)
+{
+	if (stream >= MRP_MAX_STREAMS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (check_distinct(to, npeers) == -1)
+		return -1;
+	struct payload *pl = payload_new(buf, nbytes);
+	if (!pl) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	uint64_t now = engine_now(eng);
+	ssize_t sent = 0;
+	pthread_mutex_lock(&eng->peers.lock);
+	for (size_t base = 0; base < npeers; base += MRP_BATCH) {
+		struct mrp_frame frames[MRP_BATCH];
+		uint8_t hdrs[MRP_BATCH][HDR_BUF];
+		struct peer *peers[MRP_BATCH];
+		uint32_t seqs[MRP_BATCH];
+		size_t cnt = 0;
+
+		for (size_t i = base; i < MIN(npeers, base + MRP_BATCH); i++) {
+			struct peer *peer = peer_table_get(&eng->peers, &to[i],
+							   eng->initial_seq);
+			struct unack_mess *mess = malloc(sizeof(*mess));
+			if (!peer || !mess) {
+				free(mess);
+				continue;
+			}
+			struct stream_state *st = &peer->streams[stream];
+			seqs[cnt] = st->send_seq;
+			init_unack_mess(mess, seqs[cnt], stream, st, pl, now,
+					&to[i], sizeof(to[i]));
+			hashtable_insert_message(&eng->unacknowledged_messages,
+						 mess);
+			struct frame_epoch fe;
+			build_frame(&frames[cnt], hdrs[cnt], eng->checksum,
+				    stream_epoch(eng, st, &fe), seqs[cnt],
+				    seq_len(eng, st), MT_Data, stream, pl->data,
+				    pl->len, &to[i], sizeof(to[i]));
+			peers[cnt++] = peer;
+		}
+
+		// Same rule as mrp_engine_send, a frame that did not go out
+		// gives its sequence number back
+		size_t i = 0;
+		while (i < cnt) {
+			size_t ok = send_frames(eng, frames + i, cnt - i);
+			for (size_t j = i; j < i + ok; j++)
+				peers[j]->streams[stream].send_seq++;
+			sent += ok;
+			i += ok;
+			if (i < cnt) {
+				hashtable_delete_message(
+				    &eng->unacknowledged_messages, seqs[i],
+				    stream, frames[i].to);
+				i++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&eng->peers.lock);
+	payload_put(pl);
+	unacked_removed(eng);
+
+	if (sent == 0 && npeers > 0)
+		return -1;
+	return sent;
+}
+
+int mrp_engine_set_priority(struct mrp_engine *eng, uint8_t stream,
+			    int priority)
+{
+	if (stream >= MRP_MAX_STREAMS) {
+		errno = EINVAL;
+		return -1;
+	}
+	eng->priority[stream] = priority;
+	return 0;
+}
+
+// Highest priority stream with something to deliver, or -1. File chunks
+// are never handed to a receiver which asked for any message.
+static int ready_stream(struct mrp_engine *eng)
+{
+	int best = -1;
+	for (int i = 0; i < MRP_MAX_STREAMS; i++) {
+		if (i == MRP_FILE_STREAM ||
+		    message_list_cnt(&eng->received_message[i]) == 0)
+			continue;
+		if (best == -1 || eng->priority[i] > eng->priority[best])
+			best = i;
+	}
+	return best;
+}
+
+static bool has_ready(struct mrp_engine *eng, int stream)
+{
+	if (stream < 0)
+		return ready_stream(eng) >= 0;
+	return message_list_cnt(&eng->received_message[stream]) > 0;
+}
+
+void mrp_engine_wait_recv(struct mrp_engine *eng, int stream)
+{
+	if (stream >= MRP_MAX_STREAMS)
+		return;
+	pthread_mutex_lock(&eng->recv_lock);
+	while (!has_ready(eng, stream))
+		pthread_cond_wait(&eng->recv_cond, &eng->recv_lock);
+	pthread_mutex_unlock(&eng->recv_lock);
+}
+
+ssize_t mrp_engine_recv_borrow(struct mrp_engine *eng, int stream,
+			       const void **data, struct sockaddr_in *from,
+			       socklen_t *from_len)
+{
+	if (stream >= MRP_MAX_STREAMS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (stream < 0)
+		stream = ready_stream(eng);
+	if (stream < 0 ||
+	    message_list_cnt(&eng->received_message[stream]) == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	struct message *msg =
+	    message_list_pop_first(&eng->received_message[stream]);
+
+	*data = msg->buf;
+	*from = msg->addr;
+	*from_len = msg->addr_len;
+	return msg->buf_len;
+}
+
+void mrp_engine_recv_release(const void *data)
+{
+	message_put(&rxbuf_of(data)->msg);
+}
+
+ssize_t mrp_engine_recv(struct mrp_engine *eng, int stream, void *buf,
+			size_t nbytes, struct sockaddr_in *from,
+			socklen_t *from_len)
+{
+	const void *data;
+	ssize_t len = mrp_engine_recv_borrow(eng, stream, &data, from, from_len);
+	if (len == -1)
+		return -1;
+	len = MIN(nbytes, (size_t)len);
+	memcpy(buf, data, len);
+	mrp_engine_recv_release(data);
+	return len;
+}
+
+void mrp_engine_set_recv_notify(struct mrp_engine *eng,
+				void (*notify)(void *ctx), void *ctx)
+{
+	eng->recv_notify_ctx = ctx;
+	eng->recv_notify = notify;
+}
+
+int mrp_engine_setopt(struct mrp_engine *eng, int opt, uint32_t value)
+{
+	switch (opt) {
+	case MRP_OPT_COMPACT_HEADER:
+		eng->compact = value != 0;
+		return 0;
+	case MRP_OPT_CHECKSUM:
+		eng->checksum = value != 0;
+		return 0;
+	case MRP_OPT_FAKE_LOSS:
+		if (value > 100) {
+			errno = EINVAL;
+			return -1;
+		}
+		eng->drop_prob = value / 100.0f;
+		return 0;
+	case MRP_ENGINE_OPT_INITIAL_SEQ:
+		eng->initial_seq = value;
+		return 0;
+	case MRP_ENGINE_OPT_EPOCH:
+		eng->epoch = value;
+		return 0;
+	}
+	errno = ENOPROTOOPT;
+	return -1;
+}
+
+size_t mrp_engine_unacked(struct mrp_engine *eng)
+{
+	return hashtable_cnt(&eng->unacknowledged_messages);
+}
+
+int mrp_engine_flush(struct mrp_engine *eng, int timeout_ms)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if (timeout_ms > 0) {
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	int ret = 0;
+	pthread_mutex_lock(&eng->ack_lock);
+	__atomic_add_fetch(&eng->flush_waiters, 1, __ATOMIC_SEQ_CST);
+	while (mrp_engine_unacked(eng) > 0) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&eng->ack_cond, &eng->ack_lock);
+		} else if (timeout_ms == 0 ||
+			   pthread_cond_timedwait(&eng->ack_cond,
+						  &eng->ack_lock,
+						  &deadline) == ETIMEDOUT) {
+			ret = -1;
+			break;
+		}
+	}
+	__atomic_sub_fetch(&eng->flush_waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&eng->ack_lock);
+
+	if (ret == -1)
+		errno = ETIMEDOUT;
+	return ret;
+}
+
+// Real time and real sockets for the r_* API
+
+static uint64_t monotonic_now_ms(__attribute__((unused)) void *ctx)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Packet capture
+//
+// Every thread which sends or receives frames copies them into a ring of
+// its own, without locks, and a writer thread drains the rings into a pcap
+// file. Each record is a struct capture_hdr followed by the frame as on
+// the wire, cut after the header and snaplen bytes of payload.
+
+struct capture_hdr {
+	uint8_t dir; // CAP_RX or CAP_TX
+	uint8_t reserved;
+	uint16_t port; // Peer port, network byte order
+	uint32_t addr; // Peer IPv4 address, network byte order
+};
+
+enum { CAP_RX, CAP_TX };
+
+// Laid out as a pcap record, so the writer copies it out in one go
+struct cap_rec {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+	struct capture_hdr hdr;
+	uint8_t data[CAP_SNAP_MAX];
+};
+
+// Single producer, single consumer
+struct cap_ring {
+	size_t head __attribute__((aligned(64))); // Written by the owner
+	size_t tail __attribute__((aligned(64))); // Written by the writer
+	struct cap_ring *next;
+	// The owner exited, and the ring goes to the next thread needing one
+	bool idle;
+	struct cap_rec recs[CAP_RING_SIZE];
+};
+
+static struct {
+	bool on;
+	int snaplen;
+	bool stop;
+	size_t dropped;
+	FILE *file;
+	pthread_t writer;
+	// Every ring ever allocated. There are only as many as threads have
+	// captured at the same time, as a thread hands its ring on when it
+	// exits. Records an exited thread left behind are still drained.
+	pthread_mutex_t lock;
+	struct cap_ring *rings;
+} capture = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread struct cap_ring *cap_my_ring;
+// Only there for its destructor, which runs when a thread with a ring exits
+static pthread_key_t cap_ring_key;
+static pthread_once_t cap_ring_key_once = PTHREAD_ONCE_INIT;
+
+static void cap_ring_release(void *ptr)
+{
+	struct cap_ring *ring = ptr;
+	pthread_mutex_lock(&capture.lock);
+	ring->idle = true;
+	pthread_mutex_unlock(&capture.lock);
+}
+
+static void cap_ring_key_create(void)
+{
+	pthread_key_create(&cap_ring_key, cap_ring_release);
+}
+
+static struct cap_ring *cap_ring_get(void)
+{
+	if (cap_my_ring)
+		return cap_my_ring;
+	pthread_once(&cap_ring_key_once, cap_ring_key_create);
+
+	// The lock orders the last records of the old owner before ours
+	struct cap_ring *ring;
+	pthread_mutex_lock(&capture.lock);
+	for (ring = capture.rings; ring && !ring->idle; ring = ring->next)
+		;
+	if (ring)
+		ring->idle = false;
+	pthread_mutex_unlock(&capture.lock);
+
+	if (!ring) {
+		ring = aligned_alloc(64, sizeof(*ring));
+		if (!ring)
+			return NULL;
+		ring->head = ring->tail = 0;
+		ring->idle = false;
+		pthread_mutex_lock(&capture.lock);
+		ring->next = capture.rings;
+		capture.rings = ring;
+		pthread_mutex_unlock(&capture.lock);
+	}
+	pthread_setspecific(cap_ring_key, ring);
+	return cap_my_ring = ring;
+}
+
+// Length of the MRP header at the start of a frame, clamped to len
+static size_t cap_hdr_len(const uint8_t *frame, size_t len)
+{
+	if (len == 0)
+		return 0;
+	size_t hdr = 1 + !!(frame[0] & MT_F_Stream) +
+		     (frame[0] & MT_F_Epoch ? EPOCH_LEN : 0) +
+		     ((frame[0] >> MT_SEQ_LEN_SHIFT) & 0x3) + 1;
+	return MIN(hdr, len);
+}
+
+// Out of line and cold, so that the send and receive paths only grow by
+// the test in capturing()
+static __attribute__((noinline, cold)) void
+capture_frame(int dir, const struct sockaddr_in *peer, const struct iovec *iov,
+	      int iovcnt)
+{
+	struct cap_ring *ring = cap_ring_get();
+	if (!ring)
+		return;
+	size_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+	    CAP_RING_SIZE) {
+		__atomic_add_fetch(&capture.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct cap_rec *rec = &ring->recs[head % CAP_RING_SIZE];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec->ts_sec = ts.tv_sec;
+	rec->ts_nsec = ts.tv_nsec;
+	rec->hdr.dir = dir;
+	rec->hdr.reserved = 0;
+	rec->hdr.port = peer->sin_port;
+	rec->hdr.addr = peer->sin_addr.s_addr;
+
+	size_t orig = 0;
+	for (int i = 0; i < iovcnt; i++)
+		orig += iov[i].iov_len;
+	const uint8_t *first = iov[0].iov_base;
+	size_t snap = MIN(cap_hdr_len(first, iov[0].iov_len) +
+			      capture.snaplen,
+			  CAP_SNAP_MAX);
+	size_t len = 0;
+	for (int i = 0; i < iovcnt && len < snap; i++) {
+		size_t n = MIN(iov[i].iov_len, snap - len);
+		memcpy(rec->data + len, iov[i].iov_base, n);
+		len += n;
+	}
+	rec->incl_len = sizeof(rec->hdr) + len;
+	rec->orig_len = sizeof(rec->hdr) + orig;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// All capture costs while it is off: a load and a branch predicted not taken
+static inline bool capturing(void)
+{
+	return __builtin_expect(__atomic_load_n(&capture.on, __ATOMIC_RELAXED),
+				0);
+}
+
+static void cap_drain(void)
+{
+	pthread_mutex_lock(&capture.lock);
+	for (struct cap_ring *ring = capture.rings; ring; ring = ring->next) {
+		size_t tail = ring->tail;
+		size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++) {
+			struct cap_rec *rec = &ring->recs[tail % CAP_RING_SIZE];
+			size_t len = offsetof(struct cap_rec, hdr) + rec->incl_len;
+			fwrite(rec, len, 1, capture.file);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&capture.lock);
+}
+
+static void *capture_writer(__attribute__((unused)) void *data)
+{
+	const struct timespec period = {.tv_nsec = CAP_FLUSH_MS * 1000000};
+	while (!__atomic_load_n(&capture.stop, __ATOMIC_ACQUIRE)) {
+		cap_drain();
+		fflush(capture.file);
+		nanosleep(&period, NULL);
+	}
+	cap_drain();
+	return NULL;
+}
+
+int r_capture_start(__attribute__((unused)) int sockfd, const char *path,
+		    int snaplen)
+{
+	if (capture.file || snaplen < 0) {
+		errno = capture.file ? EBUSY : EINVAL;
+		return -1;
+	}
+	capture.file = fopen(path, "wb");
+	if (!capture.file)
+		return -1;
+	// pcap file header: magic for nanosecond timestamps, version 2.4,
+	// no time zone, snapshot length and LINKTYPE_USER0
+	uint32_t fh[6] = {0xa1b23c4d, 2 | 4 << 16, 0, 0,
+			  sizeof(struct capture_hdr) + CAP_SNAP_MAX, 147};
+	if (fwrite(fh, sizeof(fh), 1, capture.file) != 1) {
+		fclose(capture.file);
+		capture.file = NULL;
+		return -1;
+	}
+
+	// Anything left in the rings is from an earlier capture
+	pthread_mutex_lock(&capture.lock);
+	for (struct cap_ring *ring = capture.rings; ring; ring = ring->next)
+		ring->tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&capture.lock);
+
+	capture.snaplen = snaplen;
+	capture.dropped = 0;
+	capture.stop = false;
+	pthread_create(&capture.writer, NULL, capture_writer, NULL);
+	__atomic_store_n(&capture.on, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+ssize_t r_capture_stop(__attribute__((unused)) int sockfd)
+{
+	if (!capture.file) {
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_store_n(&capture.on, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&capture.stop, true, __ATOMIC_RELEASE);
+	pthread_join(capture.writer, NULL);
+	int ret = fclose(capture.file);
+	capture.file = NULL;
+	return ret == 0 ? (ssize_t)capture.dropped : -1;
+}
+
+static ssize_t udp_send(void *ctx, const struct iovec *iov, int iovcnt,
+			const struct sockaddr_in *to, socklen_t to_len)
+{
+	struct msghdr mh = {
+	    .msg_name = (void *)to,
+	    .msg_namelen = to_len,
+	    .msg_iov = (struct iovec *)iov,
+	    .msg_iovlen = iovcnt,
+	};
+	if (capturing())
+		capture_frame(CAP_TX, to, iov, iovcnt);
+	return sendmsg(*(int *)ctx, &mh, 0);
+}
+
+static int udp_send_batch(void *ctx, const struct mrp_frame *frames,
+			  unsigned int n)
+{
+	struct mmsghdr msgs[MRP_BATCH];
+	n = MIN(n, MRP_BATCH);
+	memset(msgs, 0, n * sizeof(*msgs));
+	for (unsigned int i = 0; i < n; i++) {
+		msgs[i].msg_hdr.msg_name = (void *)frames[i].to;
+		msgs[i].msg_hdr.msg_namelen = frames[i].to_len;
+		msgs[i].msg_hdr.msg_iov = (struct iovec *)frames[i].iov;
+		msgs[i].msg_hdr.msg_iovlen = frames[i].iovcnt;
+	}
+	int ret = sendmmsg(*(int *)ctx, msgs, n, 0);
+	if (capturing())
+		for (int i = 0; i < ret; i++)
+			capture_frame(CAP_TX, frames[i].to, frames[i].iov,
+				      frames[i].iovcnt);
+	return ret;
+}
+
+// One socket of the endpoint with the engine serving the peers steered to
+// it. Without MRP_OPT_SHARDS there is only shards[0].
+struct shard {
+	int fd;
+	struct mrp_engine *eng;
+	pthread_t rcv_tid;
+	// Set by r_close, which then shuts down fd to wake the receiver
+	bool stop;
+};
+
+struct shard shards[MRP_MAX_SHARDS];
+int nshards = 1;
+// Set by r_bind. Sends are only spread over the shards once they share the
+// bound port, and the shard count can no longer change.
+static bool shards_bound;
+
+// Woken whenever any shard delivers. r_recvfrom waits on this rather than
+// on an engine, as r_close from a signal handler which interrupted it
+// could never destroy the engine's condition variable.
+static pthread_mutex_t shard_recv_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shard_recv_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long shard_recv_gen;
+
+// The shard a peer belongs to. Must agree with shard_steering_prog so that
+// ACKs and data from the peer reach the engine which talks to it.
+static struct shard *shard_of(const struct sockaddr_in *addr)
+{
+	if (!shards_bound)
+		return &shards[0];
+	uint32_t h = ntohl(addr->sin_addr.s_addr) ^ ntohs(addr->sin_port);
+	return &shards[h % nshards];
+}
+
+// Thread R, one per shard. It is stopped rather than cancelled, as the
+// engine takes locks and sends ACKs and completions in between.
+static void *receiver_thread(void *data)
+{
+	struct shard *sh = data;
+	struct rx_buf *rb = NULL;
+	while (!__atomic_load_n(&sh->stop, __ATOMIC_ACQUIRE)) {
+		struct sockaddr_in addr;
+		socklen_t addr_len = sizeof(addr);
+		if (!rb && !(rb = rxbuf_get())) {
+			sleep(1);
+			continue;
+		}
+		// The kernel writes the datagram into the buffer which the
+		// application will later read it from
+		ssize_t ret = recvfrom(sh->fd, rb->data, RECV_BUF_SIZE, 0,
+				       (struct sockaddr *)&addr, &addr_len);
+
+		if (ret == -1)
+			continue;
+		if (capturing()) {
+			struct iovec iov = {.iov_base = rb->data,
+					    .iov_len = ret};
+			capture_frame(CAP_RX, &addr, &iov, 1);
+		}
+		if (engine_input(sh->eng, rb, ret, &addr, addr_len))
+			rb = NULL;
+	}
+	if (rb)
+		rxbuf_put(rb);
+	return NULL;
+}
+
+// Thread S
+static void *resender_thread(__attribute__((unused)) void *data)
+{
+	for (;;) {
+		sleep(T);
+		// r_close cancels us, but only while we sleep. A tick holds the
+		// engine's locks across its sends.
+		int state;
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+		for (int i = 0; i < nshards; i++)
+			mrp_engine_tick(shards[i].eng);
+		pthread_setcancelstate(state, NULL);
+	}
+	unreachable("resender loop should never exit");
+}
+
+pthread_t snd_tid;
+
+static void shard_recv_notify(__attribute__((unused)) void *ctx)
+{
+	pthread_mutex_lock(&shard_recv_lock);
+	shard_recv_gen++;
+	pthread_cond_broadcast(&shard_recv_cond);
+	pthread_mutex_unlock(&shard_recv_lock);
+}
+
+static int shard_open(struct shard *sh, int fd)
+{
+	const struct mrp_clock clock = {.now_ms = monotonic_now_ms};
+	const struct mrp_io io = {
+	    .send = udp_send,
+	    .send_batch = udp_send_batch,
+	    .ctx = &sh->fd,
+	};
+	sh->fd = fd;
+	sh->stop = false;
+	sh->eng = mrp_engine_new(&clock, &io, DROP_PROBABILITY);
+	if (!sh->eng)
+		return -1;
+	mrp_engine_set_recv_notify(sh->eng, shard_recv_notify, NULL);
+	return 0;
+}
+
+// Completions of messages sent with r_sendto_cookie, in the order they
+// were acknowledged. efd counts up once per entry while any are queued. It
+// is written after the entry is queued and the lock dropped, so a reader
+// may find it readable with the queue already drained, but never the other
+// way round.
+static struct {
+	pthread_mutex_t lock;
+	struct r_completion *ring;
+	size_t head;
+	size_t cnt;
+	size_t cap;
+	int efd;
+} cq = {.lock = PTHREAD_MUTEX_INITIALIZER, .efd = -1};
+
+// How long r_close waits for outstanding ACKs, -1 for as long as it takes
+static int linger_ms = LINGER_MS;
+
+static void cq_post(void *ctx, int status)
+{
+	uint64_t *cookie = ctx;
+	pthread_mutex_lock(&cq.lock);
+	if (cq.cnt == cq.cap) {
+		size_t cap = cq.cap ? 2 * cq.cap : 64;
+		struct r_completion *ring = malloc(cap * sizeof(*ring));
+		if (!ring) {
+			pthread_mutex_unlock(&cq.lock);
+			free(cookie);
+			return;
+		}
+		for (size_t i = 0; i < cq.cnt; i++)
+			ring[i] = cq.ring[(cq.head + i) % cq.cap];
+		free(cq.ring);
+		cq.ring = ring;
+		cq.head = 0;
+		cq.cap = cap;
+	}
+	struct r_completion *c = &cq.ring[(cq.head + cq.cnt++) % cq.cap];
+	c->cookie = *cookie;
+	c->status = status;
+	int efd = cq.efd;
+	pthread_mutex_unlock(&cq.lock);
+	free(cookie);
+
+	// Our caller may hold the engine's locks, so nobody should have to
+	// wait for cq.lock while the eventfd is written
+	uint64_t one = 1;
+	if (efd != -1 && write(efd, &one, sizeof(one)) == -1)
+		perror("Failed to signal completion");
+}
+
+int r_socket(int family, int type, int protocol)
+{
+	if (type != SOCK_MRP) {
+		errno = EINVAL;
+		return -1;
+	}
+	int fd = socket(family, SOCK_DGRAM, protocol);
+	if (fd == -1)
+		return -1;
+
+	// Setup threads and data structures
+	nshards = 1;
+	shards_bound = false;
+	if (shard_open(&shards[0], fd) == -1) {
+		close(fd);
+		return -1;
+	}
+	cq.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cq.efd == -1) {
+		mrp_engine_free(shards[0].eng);
+		close(fd);
+		return -1;
+	}
+	pthread_create(&shards[0].rcv_tid, NULL, receiver_thread, &shards[0]);
+	pthread_create(&snd_tid, NULL, resender_thread, NULL);
+
+	// Seed rand for dropMessage
+	srand(time(NULL));
+	return fd;
+}
+
+// Give a new shard the options already set on the socket
+static void engine_copy_settings(struct mrp_engine *dst,
+				 const struct mrp_engine *src)
+{
+	memcpy(dst->priority, src->priority, sizeof(dst->priority));
+	dst->drop_prob = src->drop_prob;
+	dst->compact = src->compact;
+	dst->checksum = src->checksum;
+	dst->initial_seq = src->initial_seq;
+}
+
+// Create the sockets and engines of shards 1..n-1. They only get their
+// port and receive threads in r_bind.
+static int shards_create(int n)
+{
+	if (n < 1 || n > MRP_MAX_SHARDS || nshards != 1 || shards_bound) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (int i = 1; i < n; i++) {
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd == -1 || shard_open(&shards[i], fd) == -1) {
+			if (fd != -1)
+				close(fd);
+			while (--i > 0) {
+				mrp_engine_free(shards[i].eng);
+				close(shards[i].fd);
+			}
+			return -1;
+		}
+		engine_copy_settings(shards[i].eng, shards[0].eng);
+	}
+	nshards = n;
+	return 0;
+}
+
+// Classic BPF run by the kernel for every datagram to the port, returning
+// the index of the socket in the SO_REUSEPORT group to deliver it to. The
+// group index is the order of bind, which is the order of shards.
+static int shard_steering_prog(int fd)
+{
+	struct sock_filter code[] = {
+	    // X = IP header length, A = UDP source port
+	    BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SKF_NET_OFF),
+	    BPF_STMT(BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF),
+	    BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	    // A = IP source address ^ source port
+	    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+	    BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+	    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nshards),
+	    BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+	    .len = sizeof(code) / sizeof(code[0]),
+	    .filter = code,
+	};
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+			  sizeof(prog));
+}
+
+static void shard_pin(struct shard *sh, int cpu)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 2)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % ncpus, &set);
+	pthread_setaffinity_np(sh->rcv_tid, sizeof(set), &set);
+}
+
+static int shards_bind(const struct sockaddr *addr, socklen_t addr_len)
+{
+	int one = 1;
+	for (int i = 0; i < nshards; i++)
+		if (setsockopt(shards[i].fd, SOL_SOCKET, SO_REUSEPORT, &one,
+			       sizeof(one)) == -1)
+			return -1;
+	if (shard_steering_prog(shards[0].fd) == -1)
+		return -1;
+	for (int i = 0; i < nshards; i++)
+		if (bind(shards[i].fd, addr, addr_len) == -1)
+			return -1;
+
+	for (int i = 1; i < nshards; i++)
+		pthread_create(&shards[i].rcv_tid, NULL, receiver_thread,
+			       &shards[i]);
+	for (int i = 0; i < nshards; i++)
+		shard_pin(&shards[i], i);
+	shards_bound = true;
+	return 0;
+}
+
+int r_bind(int sockfd, const struct sockaddr *addr, socklen_t addr_len)
+{
+	if (nshards > 1)
+		return shards_bind(addr, addr_len);
+	if (bind(sockfd, addr, addr_len) == -1)
+		return -1;
+	shards_bound = true;
+	return 0;
+}
+
+int r_close(int sockfd)
+{
+	// Linger while the threads are still there to retransmit and take
+	// in the ACKs
+	if (linger_ms != 0)
+		r_flush(sockfd, linger_ms);
+	if (capture.file)
+		r_capture_stop(sockfd);
+	pthread_cancel(snd_tid);
+	pthread_join(snd_tid, NULL);
+	for (int i = 0; i < nshards; i++) {
+		// Shards other than 0 only have a thread once bound
+		if (i > 0 && !shards_bound)
+			continue;
+		// Shutting down even an unconnected UDP socket makes a
+		// blocked recvfrom return, and every later one at once
+		__atomic_store_n(&shards[i].stop, true, __ATOMIC_RELEASE);
+		shutdown(shards[i].fd, SHUT_RD);
+		pthread_join(shards[i].rcv_tid, NULL);
+	}
+	for (int i = 0; i < nshards; i++) {
+		mrp_engine_free(shards[i].eng);
+		shards[i].eng = NULL;
+		if (i > 0)
+			close(shards[i].fd);
+	}
+	nshards = 1;
+	shards_bound = false;
+
+	// Freeing the engines completed whatever was left with an error,
+	// which nobody can collect any more
+	pthread_mutex_lock(&cq.lock);
+	free(cq.ring);
+	cq.ring = NULL;
+	cq.head = cq.cnt = cq.cap = 0;
+	close(cq.efd);
+	cq.efd = -1;
+	pthread_mutex_unlock(&cq.lock);
+	return close(sockfd);
+}
+
+int r_flush(__attribute__((unused)) int sockfd, int timeout_ms)
+{
+	uint64_t deadline = monotonic_now_ms(NULL) + MAX(timeout_ms, 0);
+	for (int i = 0; i < nshards; i++) {
+		int left = timeout_ms;
+		if (timeout_ms > 0) {
+			uint64_t now = monotonic_now_ms(NULL);
+			left = now < deadline ? (int)(deadline - now) : 0;
+		}
+		if (mrp_engine_flush(shards[i].eng, left) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+ssize_t r_sendto_cookie(__attribute__((unused)) int sockfd, uint8_t stream,
+			const void *buf, size_t nbytes, int flags,
+			const struct sockaddr *to, socklen_t addr_len,
+			uint64_t cookie)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)to;
+	uint64_t *ctx = malloc(sizeof(*ctx));
+	if (!ctx)
+		return -1;
+	*ctx = cookie;
+	ssize_t ret = mrp_engine_send_notify(shard_of(sin)->eng, stream, buf,
+					     nbytes, sin, addr_len, flags,
+					     cq_post, ctx);
+	if (ret == -1)
+		free(ctx);
+	return ret;
+}
+
+int r_completion_fd(__attribute__((unused)) int sockfd)
+{
+	return cq.efd;
+}
+
+ssize_t r_get_completions(__attribute__((unused)) int sockfd,
+			  struct r_completion *out, size_t max)
+{
+	pthread_mutex_lock(&cq.lock);
+	size_t n = MIN(max, cq.cnt);
+	for (size_t i = 0; i < n; i++)
+		out[i] = cq.ring[(cq.head + i) % cq.cap];
+	if (n) {
+		cq.head = (cq.head + n) % cq.cap;
+		cq.cnt -= n;
+	}
+	// Reset the eventfd once the queue is empty. A post which has yet to
+	// write it queued its entry before, so it was taken just now and at
+	// worst the eventfd becomes readable again for nothing.
+	uint64_t val;
+	if (cq.cnt == 0 && read(cq.efd, &val, sizeof(val)) == -1 &&
+	    errno != EAGAIN) {
+		pthread_mutex_unlock(&cq.lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&cq.lock);
+	return n;
+}
+
+ssize_t r_sendto(int sockfd, const void *buff, size_t nbytes, int flags,
+		 const struct sockaddr *to, socklen_t addrlen)
+{
+	return r_sendto_stream(sockfd, 0, buff, nbytes, flags, to, addrlen);
+}
+
+ssize_t r_sendto_many(__attribute__((unused)) int sockfd, const void *buff,
+		      size_t nbytes, __attribute__((unused)) int flags,
+		      const struct sockaddr_in *to, size_t npeers)
+{
+	if (nshards == 1 || !shards_bound)
+		return mrp_engine_send_many(shards[0].eng, 0, buff, nbytes, to,
+					    npeers);
+
+	// Every shard sends to its own peers
+	struct sockaddr_in *group = malloc(npeers * sizeof(*group));
+	if (!group)
+		return -1;
+	ssize_t sent = 0;
+	for (int i = 0; i < nshards; i++) {
+		size_t n = 0;
+		for (size_t j = 0; j < npeers; j++)
+			if (shard_of(&to[j]) == &shards[i])
+				group[n++] = to[j];
+		if (n == 0)
+			continue;
+		ssize_t ret = mrp_engine_send_many(shards[i].eng, 0, buff,
+						   nbytes, group, n);
+		if (ret > 0)
+			sent += ret;
+	}
+	free(group);
+	return sent;
+}
+
+ssize_t r_sendto_stream(__attribute__((unused)) int sockfd, uint8_t stream,
+			const void *buff, size_t nbytes,
+			__attribute__((unused)) int flags,
+			const struct sockaddr *to, socklen_t addrlen)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)to;
+	return mrp_engine_send(shard_of(sin)->eng, stream, buff, nbytes, sin,
+			       addrlen);
+}
+
+static ssize_t recv_borrow_blocking(int stream, const void **data,
+				    struct sockaddr *from, socklen_t *addr_len)
+{
+	// Shards are tried in turn so that none of them is starved. Stream
+	// priority only orders messages within a shard. Several threads may
+	// receive at once.
+	static unsigned int next_shard;
+	struct sockaddr_in addr;
+	socklen_t len;
+	ssize_t ret = -1;
+	for (;;) {
+		pthread_mutex_lock(&shard_recv_lock);
+		unsigned long gen = shard_recv_gen;
+		pthread_mutex_unlock(&shard_recv_lock);
+
+		unsigned int first = __atomic_fetch_add(&next_shard, 1,
+							__ATOMIC_RELAXED);
+		for (int i = 0; i < nshards && ret == -1; i++) {
+			struct shard *sh = &shards[(first + i) % nshards];
+			ret = mrp_engine_recv_borrow(sh->eng, stream, data,
+						     &addr, &len);
+			if (ret == -1 && errno != EAGAIN)
+				return -1;
+		}
+		if (ret != -1)
+			break;
+
+		pthread_mutex_lock(&shard_recv_lock);
+		while (shard_recv_gen == gen)
+			pthread_cond_wait(&shard_recv_cond, &shard_recv_lock);
+		pthread_mutex_unlock(&shard_recv_lock);
+	}
+
+	*from = *(struct sockaddr *)&addr;
+	*addr_len = len;
+	return ret;
+}
+
+static ssize_t recv_blocking(int stream, void *buf, size_t nbytes,
+			     struct sockaddr *from, socklen_t *addr_len)
+{
+	const void *data;
+	ssize_t ret = recv_borrow_blocking(stream, &data, from, addr_len);
+	if (ret == -1)
+		return -1;
+	ret = MIN(nbytes, (size_t)ret);
+	memcpy(buf, data, ret);
+	mrp_engine_recv_release(data);
+	return ret;
+}
+
+ssize_t r_recv_borrow(__attribute__((unused)) int sockfd, const void **data,
+		      __attribute__((unused)) int flags, struct sockaddr *from,
+		      socklen_t *addr_len)
+{
+	return recv_borrow_blocking(-1, data, from, addr_len);
+}
+
+void r_recv_release(__attribute__((unused)) int sockfd, const void *data)
+{
+	mrp_engine_recv_release(data);
+}
+
+ssize_t r_recvfrom(__attribute__((unused)) int sockfd, void *buf, size_t nbytes,
+		   __attribute__((unused)) int flags, struct sockaddr *from,
+		   socklen_t *addr_len)
+{
+	return recv_blocking(-1, buf, nbytes, from, addr_len);
+}
+
+ssize_t r_recvfrom_stream(__attribute__((unused)) int sockfd, uint8_t stream,
+			  void *buf, size_t nbytes,
+			  __attribute__((unused)) int flags,
+			  struct sockaddr *from, socklen_t *addr_len)
+{
+	return recv_blocking(stream, buf, nbytes, from, addr_len);
+}
+
+int r_setsockopt(__attribute__((unused)) int sockfd, int opt, int value)
+{
+	if (opt == MRP_ENGINE_OPT_INITIAL_SEQ || opt == MRP_ENGINE_OPT_EPOCH) {
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+	if (opt == MRP_OPT_SHARDS)
+		return shards_create(value);
+	if (opt == MRP_OPT_LINGER) {
+		linger_ms = value;
+		return 0;
+	}
+	for (int i = 0; i < nshards; i++)
+		if (mrp_engine_setopt(shards[i].eng, opt, value) == -1)
+			return -1;
+	return 0;
+}
+
+int r_set_stream_priority(__attribute__((unused)) int sockfd, uint8_t stream,
+			  int priority)
+{
+	for (int i = 0; i < nshards; i++)
+		if (mrp_engine_set_priority(shards[i].eng, stream, priority) ==
+		    -1)
+			return -1;
+	return 0;
+}
+
+// Chunks of a file in flight, all pointing into the same mapping
+struct file_transfer {
+	size_t inflight;
+	// Some chunk completed with an error
+	bool failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void chunk_acked(void *ptr, int status)
+{
+	struct file_transfer *xfer = ptr;
+	pthread_mutex_lock(&xfer->lock);
+	xfer->inflight--;
+	if (status != 0)
+		xfer->failed = true;
+	pthread_cond_signal(&xfer->cond);
+	pthread_mutex_unlock(&xfer->lock);
+}
+
+ssize_t r_sendfile(__attribute__((unused)) int sockfd, int file_fd,
+		   off_t offset, size_t len, const struct sockaddr *to,
+		   socklen_t addrlen)
+{
+	struct stat st;
+	if (fstat(file_fd, &st) == -1)
+		return -1;
+	if (offset < 0 || offset > st.st_size ||
+	    len > (size_t)(st.st_size - offset)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len == 0)
+		return 0;
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)to;
+
+	// mmap wants a page aligned offset
+	off_t map_off = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	size_t map_len = len + (offset - map_off);
+	uint8_t *map =
+	    mmap(NULL, map_len, PROT_READ, MAP_SHARED, file_fd, map_off);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, map_len, MADV_SEQUENTIAL);
+	uint8_t *data = map + (offset - map_off);
+
+	struct file_transfer xfer = {.inflight = 0, .failed = false};
+	pthread_mutex_init(&xfer.lock, NULL);
+	pthread_cond_init(&xfer.cond, NULL);
+
+	ssize_t ret = len;
+	for (size_t sent = 0; sent < len; sent += FILE_CHUNK) {
+		pthread_mutex_lock(&xfer.lock);
+		while (xfer.inflight >= FILE_WINDOW)
+			pthread_cond_wait(&xfer.cond, &xfer.lock);
+		xfer.inflight++;
+		pthread_mutex_unlock(&xfer.lock);
+
+		// The unacked entry points into the mapping, nothing is
+		// copied. Its release hands the window slot back.
+		struct payload *pl =
+		    payload_wrap(data + sent, MIN(FILE_CHUNK, len - sent),
+				 chunk_acked, &xfer);
+		if (!pl) {
+			chunk_acked(&xfer, 0);
+			errno = ENOMEM;
+			ret = -1;
+			break;
+		}
+		ssize_t sret =
+		    engine_send_payload(shard_of(sin)->eng, MRP_FILE_STREAM,
+					pl, sin, addrlen);
+		payload_put(pl);
+		if (sret == -1) {
+			ret = -1;
+			break;
+		}
+	}
+
+	// Chunks already sent point into the mapping until they are acked
+	int err = errno;
+	pthread_mutex_lock(&xfer.lock);
+	while (xfer.inflight > 0)
+		pthread_cond_wait(&xfer.cond, &xfer.lock);
+	pthread_mutex_unlock(&xfer.lock);
+	if (ret != -1 && xfer.failed) {
+		err = ECONNABORTED;
+		ret = -1;
+	}
+
+	pthread_mutex_destroy(&xfer.lock);
+	pthread_cond_destroy(&xfer.cond);
+	munmap(map, map_len);
+	errno = err;
+	return ret;
+}
+
+ssize_t r_recvfile(__attribute__((unused)) int sockfd, int dest_fd,
+		   size_t len, struct sockaddr *from, socklen_t *addr_len)
+{
+	if (ftruncate(dest_fd, len) == -1)
+		return -1;
+	if (len == 0)
+		return 0;
+	uint8_t *map =
+	    mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, dest_fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	size_t got = 0;
+	while (got < len) {
+		ssize_t ret = recv_blocking(MRP_FILE_STREAM, map + got,
+					    len - got, from, addr_len);
+		if (ret == -1)
+			break;
+		got += ret;
+	}
+
+	munmap(map, len);
+	return got == len ? (ssize_t)got : -1;
 }
 
 int dropMessage(float p)
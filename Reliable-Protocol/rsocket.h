@@ -2,12 +2,16 @@
 #define __RSOCKET_H__
 
 #include <arpa/inet.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #define T 2
 #define TIMEOUT (2 * T)
 #define SOCK_MRP 12
 #define DROP_PROBABILITY 0.10f
+#define MRP_MAX_STREAMS 16
+// Stream reserved for r_sendfile / r_recvfile
+#define MRP_FILE_STREAM (MRP_MAX_STREAMS - 1)
 
 int r_socket(int family, int type, int protocol);
 int r_bind(int sockfd, const struct sockaddr *addr, socklen_t addr_len);
@@ -16,6 +20,111 @@ ssize_t r_sendto(int sockfd, const void *buf, size_t nbytes, int flags,
 ssize_t r_recvfrom(int sockfd, void *buf, size_t nbytes, int flags,
 		   struct sockaddr *from, socklen_t *addr_len);
 int r_close(int sockfd);
+// Wait until every message sent so far has been acknowledged, for at most
+// timeout_ms or forever if it is negative. Returns -1 with errno set to
+// ETIMEDOUT if there still are unacknowledged messages.
+int r_flush(int sockfd, int timeout_ms);
+
+// Send completions. r_sendto_cookie works like r_sendto_stream, and once
+// the message is acknowledged {cookie, 0} is queued on the socket. With
+// MRP_SEND_ZEROCOPY in flags buf is sent from in place, and the caller
+// may only reuse it once the completion arrives or r_close returns.
+// Messages still unacknowledged at r_close are dropped without a
+// completion, as the queue goes away with the socket. Nothing is queued
+// for a send which fails outright.
+#define MRP_SEND_ZEROCOPY 0x1
+
+struct r_completion {
+	uint64_t cookie;
+	int status;
+};
+
+ssize_t r_sendto_cookie(int sockfd, uint8_t stream, const void *buf,
+			size_t nbytes, int flags, const struct sockaddr *to,
+			socklen_t addr_len, uint64_t cookie);
+// An eventfd which polls readable while completions are queued
+int r_completion_fd(int sockfd);
+// Take up to max queued completions without blocking
+ssize_t r_get_completions(int sockfd, struct r_completion *out, size_t max);
+
+// Zero-copy receive. *data is pointed at the payload of the next message,
+// inside the buffer the kernel received the datagram into, and stays valid
+// until it is handed back with r_recv_release. Returns the payload length.
+ssize_t r_recv_borrow(int sockfd, const void **data, int flags,
+		      struct sockaddr *from, socklen_t *addr_len);
+void r_recv_release(int sockfd, const void *data);
+
+// Options for r_setsockopt
+//
+// MRP_OPT_COMPACT_HEADER: send sequence numbers in as few bytes as the
+// number of unacknowledged messages allows, down to a 2 byte header.
+// Receivers understand both forms regardless of their own setting, and
+// drop compact frames numbered too far ahead to be in flight. A duplicate
+// which the network holds back while three quarters of its number's range
+// is sent after it (192 messages with 1 byte) may still be taken for a new
+// message, so leave this off on paths which delay datagrams that long.
+#define MRP_OPT_COMPACT_HEADER 1
+// MRP_OPT_SHARDS: serve the port from value sockets bound with SO_REUSEPORT,
+// each with its own receive thread pinned to a core and its own per-peer
+// state. The kernel steers every peer to one shard by its address, so a
+// flow never crosses cores. Set it before r_bind.
+#define MRP_OPT_SHARDS 2
+// MRP_OPT_FAKE_LOSS: percentage of received datagrams dropped on purpose,
+// DROP_PROBABILITY by default
+#define MRP_OPT_FAKE_LOSS 3
+// MRP_OPT_CHECKSUM: end every frame with a CRC32C, for paths where the UDP
+// checksum can't be trusted, and drop incoming frames without a valid one
+#define MRP_OPT_CHECKSUM 4
+// MRP_OPT_LINGER: how many milliseconds r_close waits for outstanding
+// messages to be acknowledged, 0 not to wait and -1 to wait for good
+#define MRP_OPT_LINGER 5
+#define MRP_MAX_SHARDS 64
+
+int r_setsockopt(int sockfd, int opt, int value);
+
+// Send one message reliably to npeers distinct peers. The payload is copied
+// once and shared, and only peers which have not acknowledged it are sent
+// retransmissions. Returns the number of peers it was sent to, or -1.
+ssize_t r_sendto_many(int sockfd, const void *buf, size_t nbytes, int flags,
+		      const struct sockaddr_in *to, size_t npeers);
+
+// Streams are sequenced, ordered and queued independently of each other,
+// so a backlog on one stream never holds up another. r_sendto and
+// r_recvfrom use stream 0; r_recvfrom takes from whichever stream with
+// data has the highest priority, apart from MRP_FILE_STREAM which only
+// r_recvfile reads.
+ssize_t r_sendto_stream(int sockfd, uint8_t stream, const void *buf,
+			size_t nbytes, int flags, const struct sockaddr *to,
+			socklen_t addr_len);
+ssize_t r_recvfrom_stream(int sockfd, uint8_t stream, void *buf,
+			  size_t nbytes, int flags, struct sockaddr *from,
+			  socklen_t *addr_len);
+// Higher priority streams are retransmitted and delivered first
+int r_set_stream_priority(int sockfd, uint8_t stream, int priority);
+
+// Send len bytes of file_fd starting at offset on MRP_FILE_STREAM. The file
+// is mapped and sent straight from the page cache with a bounded number
+// of chunks in flight. Returns len once every chunk is acknowledged, or -1
+// with errno ECONNABORTED if the socket was closed before some were.
+ssize_t r_sendfile(int sockfd, int file_fd, off_t offset, size_t len,
+		   const struct sockaddr *to, socklen_t addr_len);
+// Receive a transfer of exactly len bytes from MRP_FILE_STREAM into
+// dest_fd, which is resized to len and written through a mapping. Only one
+// transfer should be in progress on a socket at a time.
+ssize_t r_recvfile(int sockfd, int dest_fd, size_t len, struct sockaddr *from,
+		   socklen_t *addr_len);
+
+// Capture the frames sent and received to a pcap file at path, each as a
+// header followed by the start of the frame, see mrp_dissector.lua.
+// snaplen is how many bytes of payload to keep after the MRP header.
+// While on, every frame costs a clock read and a copy into a ring, and a
+// writer thread drains the rings. On one core shared by the receive thread
+// and the writer, mrp_bench -C handles 15-20% fewer datagrams per
+// second. While off, capture costs a predicted branch per frame and no
+// throughput mrp_bench can measure.
+int r_capture_start(int sockfd, const char *path, int snaplen);
+// Returns the number of frames which could not be captured in time
+ssize_t r_capture_stop(int sockfd);
 
 int dropMessage(float p);
 
@@ -66,8 +66,9 @@ int main()
 			 addrlen);
 	}
 
-	for (;;)
-		sleep(10);
+	// Lingers until user2 has acknowledged every character
+	r_close(sockfd);
+	sockfd = -1;
 	return 0;
 }
 